@@ -0,0 +1,498 @@
+/*
+ * Trace-replay benchmark for the heap allocator.
+ *
+ * Build:  make myBench
+ * Run:    ./myBench [-s heapMiB] [-n ops] [-d workload] [trace ...]
+ *
+ * Without trace files the synthetic workloads are replayed.  Each trace is
+ * replayed once per allocator configuration, in a fresh process, and one
+ * table row is printed per run, so policies and modes can be compared side
+ * by side.  -d writes a synthetic workload as a trace instead.
+ *
+ * Trace format: one operation per line, '#' starts a comment.
+ *   a <id> <size>   allocate 'size' bytes and call the block <id>
+ *   r <id> <size>   reallocate block <id> to 'size' bytes
+ *   f <id>          free block <id>
+ * Ids are small non-negative integers and may be reused after a free.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "myHeap.h"
+
+#define STATS_EVERY 64   // operations between myHeapStats() samples
+
+typedef struct traceOp {
+    char kind;           // 'a', 'r' or 'f'
+    unsigned int id;
+    size_t size;
+} traceOp;
+
+typedef struct trace {
+    const char *name;
+    traceOp *ops;
+    size_t count;
+    size_t capacity;
+    unsigned int maxId;
+} trace;
+
+/*
+ * An allocator configuration, applied with mySetOption() after myInit().
+ */
+typedef struct config {
+    const char *name;
+    int index;
+    int placement;
+    int coalesceMode;
+    int slab;
+    int threadCache;
+    long minRemainder;   // MYHEAP_OPT_MIN_REMAINDER
+    long carveHigh;      // MYHEAP_OPT_CARVE_HIGH
+} config;
+
+static const config configs[] = {
+    { "best/deferred",        MYHEAP_INDEX_SEGREGATED, MYHEAP_PLACE_BEST,  MYHEAP_COALESCE_DEFERRED,  0, 0, 0, 0 },
+    { "best/immediate",       MYHEAP_INDEX_SEGREGATED, MYHEAP_PLACE_BEST,  MYHEAP_COALESCE_IMMEDIATE, 0, 0, 0, 0 },
+    { "best/pending",         MYHEAP_INDEX_SEGREGATED, MYHEAP_PLACE_BEST,  MYHEAP_COALESCE_PENDING,   0, 0, 0, 0 },
+    { "first/immediate",      MYHEAP_INDEX_SEGREGATED, MYHEAP_PLACE_FIRST, MYHEAP_COALESCE_IMMEDIATE, 0, 0, 0, 0 },
+    { "next/immediate",       MYHEAP_INDEX_SEGREGATED, MYHEAP_PLACE_NEXT,  MYHEAP_COALESCE_IMMEDIATE, 0, 0, 0, 0 },
+    { "good/immediate",       MYHEAP_INDEX_SEGREGATED, MYHEAP_PLACE_GOOD,  MYHEAP_COALESCE_IMMEDIATE, 0, 0, 0, 0 },
+    { "tlsf/deferred",        MYHEAP_INDEX_TLSF,       MYHEAP_PLACE_BEST,  MYHEAP_COALESCE_DEFERRED,  0, 0, 0, 0 },
+    { "tlsf/immediate",       MYHEAP_INDEX_TLSF,       MYHEAP_PLACE_BEST,  MYHEAP_COALESCE_IMMEDIATE, 0, 0, 0, 0 },
+    { "tlsf/immediate+slab",  MYHEAP_INDEX_TLSF,       MYHEAP_PLACE_BEST,  MYHEAP_COALESCE_IMMEDIATE, 1, 0, 0, 0 },
+    { "tlsf/immediate+cache", MYHEAP_INDEX_TLSF,       MYHEAP_PLACE_BEST,  MYHEAP_COALESCE_IMMEDIATE, 1, 1, 0, 0 },
+    { "best/immediate/rem64", MYHEAP_INDEX_SEGREGATED, MYHEAP_PLACE_BEST,  MYHEAP_COALESCE_IMMEDIATE, 0, 0, 64, 0 },
+    { "best/immediate/high",  MYHEAP_INDEX_SEGREGATED, MYHEAP_PLACE_BEST,  MYHEAP_COALESCE_IMMEDIATE, 0, 0, 0, 1024 },
+    { "best/imm/rem64+high",  MYHEAP_INDEX_SEGREGATED, MYHEAP_PLACE_BEST,  MYHEAP_COALESCE_IMMEDIATE, 0, 0, 64, 1024 },
+    { "tlsf/immediate/high",  MYHEAP_INDEX_TLSF,       MYHEAP_PLACE_BEST,  MYHEAP_COALESCE_IMMEDIATE, 0, 0, 0, 1024 },
+};
+#define NUM_CONFIGS (sizeof(configs) / sizeof(configs[0]))
+
+/*
+ * Appends an operation to a trace.
+ */
+static void addOp(trace *t, char kind, unsigned int id, size_t size) {
+    if (t->count == t->capacity) {
+        t->capacity = t->capacity ? t->capacity * 2 : 1024;
+        t->ops = realloc(t->ops, t->capacity * sizeof(traceOp));
+        if (t->ops == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    t->ops[t->count].kind = kind;
+    t->ops[t->count].id = id;
+    t->ops[t->count].size = size;
+    t->count++;
+    if (id > t->maxId) {
+        t->maxId = id;
+    }
+}
+
+/*
+ * Function for reading a text trace.
+ * Argument path: file to read
+ * Argument t: trace to fill in
+ * Returns 0 on success.
+ * Returns -1 if the file cannot be opened or a line cannot be parsed.
+ */
+static int readTrace(const char *path, trace *t) {
+    FILE *file = fopen(path, "r");
+    char line[256];
+    int lineNo = 0;
+
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+    memset(t, 0, sizeof(*t));
+    t->name = path;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char kind;
+        unsigned int id;
+        unsigned long size = 0;
+        char *hash = strchr(line, '#');
+        int fields;
+
+        lineNo++;
+        if (hash != NULL) {
+            *hash = '\0';
+        }
+        fields = sscanf(line, " %c %u %lu", &kind, &id, &size);
+        if (fields <= 0) {
+            continue;     // blank or comment
+        }
+        if (!((kind == 'a' || kind == 'r') && fields == 3) && !(kind == 'f' && fields >= 2)) {
+            fprintf(stderr, "%s:%d: cannot parse operation\n", path, lineNo);
+            fclose(file);
+            return -1;
+        }
+        addOp(t, kind, id, size);
+    }
+    fclose(file);
+    return 0;
+}
+
+/*
+ * Uniformly distributed small blocks with random frees and reuse.
+ */
+static void makeUniform(trace *t, size_t ops) {
+    unsigned int slots = 4096;
+    char *live = calloc(slots, 1);
+    size_t i;
+
+    for (i = 0; i < ops; i++) {
+        unsigned int id = rand() % slots;
+        if (live[id]) {
+            addOp(t, 'f', id, 0);
+        } else {
+            addOp(t, 'a', id, 8 + rand() % 121);
+        }
+        live[id] = !live[id];
+    }
+    free(live);
+}
+
+/*
+ * Mostly small blocks, with one in sixteen between 4 KiB and 64 KiB, and
+ * some of them grown with realloc.
+ */
+static void makeBimodal(trace *t, size_t ops) {
+    unsigned int slots = 2048;
+    size_t *sizes = calloc(slots, sizeof(size_t));
+    size_t i;
+
+    for (i = 0; i < ops; i++) {
+        unsigned int id = rand() % slots;
+        if (sizes[id] == 0) {
+            sizes[id] = rand() % 16 == 0 ? 4096 + rand() % 61441 : 16 + rand() % 49;
+            addOp(t, 'a', id, sizes[id]);
+        } else if (rand() % 8 == 0) {
+            sizes[id] += sizes[id] / 2;
+            addOp(t, 'r', id, sizes[id]);
+        } else {
+            addOp(t, 'f', id, 0);
+            sizes[id] = 0;
+        }
+    }
+    free(sizes);
+}
+
+/*
+ * A producer allocates messages in bursts and a consumer frees them in
+ * the order they were made.
+ */
+static void makeProducerConsumer(trace *t, size_t ops) {
+    unsigned int slots = 8192;
+    unsigned int head = 0;  // next id to produce
+    unsigned int tail = 0;  // next id to consume
+    size_t i = 0;
+
+    while (i < ops) {
+        int burst = 1 + rand() % 64;
+        while (burst-- > 0 && head - tail < slots && i < ops) {
+            addOp(t, 'a', head % slots, 32 + rand() % 480);
+            head++;
+            i++;
+        }
+        burst = 1 + rand() % 64;
+        while (burst-- > 0 && tail != head && i < ops) {
+            addOp(t, 'f', tail % slots, 0);
+            tail++;
+            i++;
+        }
+    }
+}
+
+/*
+ * Rounds of small and large blocks made side by side, after which the
+ * large ones are freed and the holes between the small ones are asked
+ * for slightly larger blocks that do not fit them.
+ */
+static void makeFragmenting(trace *t, size_t ops) {
+    unsigned int pairs = 1024;
+    unsigned int id;
+    size_t i = 0;
+
+    while (i < ops) {
+        for (id = 0; id < pairs && i < ops; id++, i += 2) {
+            addOp(t, 'a', 2 * id, 16 + rand() % 32);
+            addOp(t, 'a', 2 * id + 1, 256 + rand() % 256);
+        }
+        for (id = 0; id < pairs && i < ops; id++, i++) {
+            addOp(t, 'f', 2 * id + 1, 0);
+        }
+        for (id = 0; id < pairs && i < ops; id++, i++) {
+            addOp(t, 'a', 2 * pairs + id, 520 + rand() % 512);
+        }
+        for (id = 0; id < pairs && i + 1 < ops; id++, i += 2) {
+            addOp(t, 'f', 2 * id, 0);
+            addOp(t, 'f', 2 * pairs + id, 0);
+        }
+    }
+}
+
+static const struct workload {
+    const char *name;
+    void (*make)(trace *t, size_t ops);
+} workloads[] = {
+    { "uniform",      makeUniform },
+    { "bimodal",      makeBimodal },
+    { "prodcons",     makeProducerConsumer },
+    { "fragmenting",  makeFragmenting },
+};
+#define NUM_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+/*
+ * Function for building a synthetic trace.
+ * Argument name: one of the workload names
+ * Argument ops: number of operations to generate
+ * Argument t: trace to fill in
+ * Returns 0 on success.
+ * Returns -1 if there is no workload called 'name'.
+ */
+static int makeTrace(const char *name, size_t ops, trace *t) {
+    size_t w;
+
+    for (w = 0; w < NUM_WORKLOADS; w++) {
+        if (strcmp(name, workloads[w].name) == 0) {
+            memset(t, 0, sizeof(*t));
+            t->name = workloads[w].name;
+            srand(1);   // the same trace for every run
+            workloads[w].make(t, ops);
+            return 0;
+        }
+    }
+    fprintf(stderr, "Error:myBench: no workload called %s\n", name);
+    return -1;
+}
+
+static double nowNs() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Replays a trace against the default heap and prints one table row.
+ * Run in a child process so every configuration starts from a fresh heap.
+ * A request that fails in a mode other than MYHEAP_COALESCE_IMMEDIATE is
+ * retried once after coalesce(), as a caller of this allocator would.
+ */
+static void replay(const trace *t, const config *c, size_t heapSize) {
+    void **blocks = calloc(t->maxId + 1, sizeof(void *));
+    size_t *sizes = calloc(t->maxId + 1, sizeof(size_t));
+    double *latency = malloc(t->count * sizeof(double));
+    size_t live = 0;
+    size_t peakLive = 0;
+    size_t peakHeld = 0;
+    double fragSum = 0;
+    unsigned long samples = 0;
+    unsigned long failed = 0;
+    double total = 0;
+    myStats_t stats;
+    size_t i;
+
+    if (blocks == NULL || sizes == NULL || latency == NULL || myInit(heapSize) != 0) {
+        fprintf(stderr, "Error:myBench: cannot set up the heap\n");
+        exit(1);
+    }
+    mySetOption(MYHEAP_OPT_GROW, 1);
+    mySetOption(MYHEAP_OPT_INDEX, c->index);
+    mySetOption(MYHEAP_OPT_PLACEMENT, c->placement);
+    mySetOption(MYHEAP_OPT_COALESCE, c->coalesceMode);
+    mySetOption(MYHEAP_OPT_SLAB, c->slab);
+    mySetOption(MYHEAP_OPT_THREAD_CACHE, c->threadCache);
+    mySetOption(MYHEAP_OPT_MIN_REMAINDER, c->minRemainder);
+    mySetOption(MYHEAP_OPT_CARVE_HIGH, c->carveHigh);
+
+    for (i = 0; i < t->count; i++) {
+        const traceOp *op = &t->ops[i];
+        void *ptr = NULL;
+        double start = nowNs();
+
+        switch (op->kind) {
+        case 'a':
+            ptr = myAlloc(op->size);
+            if (ptr == NULL && c->coalesceMode != MYHEAP_COALESCE_IMMEDIATE) {
+                coalesce();
+                ptr = myAlloc(op->size);
+            }
+            break;
+        case 'r':
+            ptr = myRealloc(blocks[op->id], op->size);
+            if (ptr == NULL && c->coalesceMode != MYHEAP_COALESCE_IMMEDIATE) {
+                coalesce();
+                ptr = myRealloc(blocks[op->id], op->size);
+            }
+            break;
+        default:
+            myFree(blocks[op->id]);
+            break;
+        }
+        latency[i] = nowNs() - start;
+        total += latency[i];
+
+        if (op->kind == 'f') {
+            live -= sizes[op->id];
+            blocks[op->id] = NULL;
+            sizes[op->id] = 0;
+        } else if (ptr == NULL) {
+            failed++;
+        } else {
+            live += op->size - sizes[op->id];
+            blocks[op->id] = ptr;
+            sizes[op->id] = op->size;
+            // A trace may touch the memory, so the replay does too
+            memset(ptr, 0xA5, op->size < 64 ? op->size : 64);
+        }
+        if (live > peakLive) {
+            peakLive = live;
+            myHeapStats(NULL, &stats);
+            if (stats.usedBytes + stats.hugeBytes > peakHeld) {
+                peakHeld = stats.usedBytes + stats.hugeBytes;
+            }
+        }
+        if (i % STATS_EVERY == 0 || i + 1 == t->count) {
+            myHeapStats(NULL, &stats);
+            if (stats.usedBytes + stats.hugeBytes > peakHeld) {
+                peakHeld = stats.usedBytes + stats.hugeBytes;
+            }
+            if (stats.freeBytes != 0) {
+                fragSum += 1.0 - (double)stats.largestFree / stats.freeBytes;
+                samples++;
+            }
+        }
+    }
+
+    qsort(latency, t->count, sizeof(double), compareDoubles);
+    printf("%-12s %-22s %10.0f %8.0f %8.0f %8.0f %7.1f%% %7.1f%% %7lu\n",
+           t->name, c->name,
+           t->count / (total / 1e9),
+           latency[t->count / 2],
+           latency[t->count * 99 / 100],
+           latency[t->count * 999 / 1000],
+           peakHeld != 0 ? 100.0 * peakLive / peakHeld : 0.0,
+           samples != 0 ? 100.0 * fragSum / samples : 0.0,
+           failed);
+}
+
+/*
+ * Replays a trace once per configuration, each in its own process.
+ */
+static void runAll(const trace *t, size_t heapSize) {
+    size_t c;
+
+    for (c = 0; c < NUM_CONFIGS; c++) {
+        pid_t pid;
+        fflush(stdout);
+        pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            exit(1);
+        }
+        if (pid == 0) {
+            replay(t, &configs[c], heapSize);
+            fflush(stdout);
+            _exit(0);
+        }
+        waitpid(pid, NULL, 0);
+    }
+}
+
+/*
+ * Writes a trace in the text format.
+ */
+static void writeTrace(const trace *t, FILE *out) {
+    size_t i;
+
+    fprintf(out, "# %s, %zu operations\n", t->name, t->count);
+    for (i = 0; i < t->count; i++) {
+        if (t->ops[i].kind == 'f') {
+            fprintf(out, "f %u\n", t->ops[i].id);
+        } else {
+            fprintf(out, "%c %u %zu\n", t->ops[i].kind, t->ops[i].id, t->ops[i].size);
+        }
+    }
+}
+
+static void usage(const char *prog) {
+    size_t w;
+
+    fprintf(stderr, "usage: %s [-s heapMiB] [-n ops] [-d workload] [trace ...]\nworkloads:", prog);
+    for (w = 0; w < NUM_WORKLOADS; w++) {
+        fprintf(stderr, " %s", workloads[w].name);
+    }
+    fprintf(stderr, "\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    size_t heapSize = 64UL << 20;
+    size_t ops = 1000000;
+    const char *dump = NULL;
+    trace t;
+    int opt;
+    size_t w;
+
+    while ((opt = getopt(argc, argv, "s:n:d:")) != -1) {
+        switch (opt) {
+        case 's':
+            heapSize = strtoul(optarg, NULL, 10) << 20;
+            break;
+        case 'n':
+            ops = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            dump = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (heapSize == 0 || ops == 0) {
+        usage(argv[0]);
+    }
+    if (dump != NULL) {
+        if (makeTrace(dump, ops, &t) != 0) {
+            usage(argv[0]);
+        }
+        writeTrace(&t, stdout);
+        return 0;
+    }
+
+    printf("%-12s %-22s %10s %8s %8s %8s %8s %8s %7s\n", "trace", "config", "ops/s",
+           "p50 ns", "p99 ns", "p99.9 ns", "util", "frag", "failed");
+    if (optind == argc) {
+        for (w = 0; w < NUM_WORKLOADS; w++) {
+            makeTrace(workloads[w].name, ops, &t);
+            runAll(&t, heapSize);
+            free(t.ops);
+        }
+    }
+    for (; optind < argc; optind++) {
+        if (readTrace(argv[optind], &t) != 0) {
+            return 1;
+        }
+        if (t.count != 0) {
+            runAll(&t, heapSize);
+        }
+        free(t.ops);
+    }
+    printf("\nutil: peak live bytes over peak bytes held (used blocks plus huge mappings)\n"
+           "frag: mean of 1 - largest free block / free bytes, sampled every %d operations\n",
+           STATS_EVERY);
+    return 0;
+}
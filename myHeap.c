@@ -1,11 +1,19 @@
-
+#define _GNU_SOURCE // mremap, MAP_ANONYMOUS
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <execinfo.h>
+#include <sys/syscall.h>
+#include <sys/file.h>
 #include "myHeap.h"
  
 /*
@@ -14,10 +22,12 @@
  */
 typedef struct blockHeader {           
 
-    int size_status;
+    size_t size_status;
     /*
      * Size of the block is always a multiple of 8.
      * Size is stored in all block headers and in free block footers.
+     * Headers and footers are 8 bytes wide, so a block is at least 16 bytes
+     * and sizes are limited only by the address space.
      *
      * Status is stored only in headers using the two least significant bits.
      *   Bit0 => least significant bit, last bit
@@ -27,6 +37,12 @@ typedef struct blockHeader {
      *   Bit1 => second last bit 
      *   Bit1 == 0 => previous block is free
      *   Bit1 == 1 => previous block is allocated
+     *
+     *   Bit2 in a free block, see releaseFreePages()
+     *   Bit2 == 1 => the pages inside the block were given back and read
+     *                as zero
+     *   Bit2 in an allocated block, see markRemote()
+     *   Bit2 == 1 => the block is queued to be freed
      * 
      * End Mark: 
      *  The end of the available memory is indicated using a size_status of 1.
@@ -53,194 +69,3810 @@ typedef struct blockHeader {
 blockHeader *heapStart = NULL;     
 
 /* Size of heap allocation padded to round to nearest page size.
+ * Once the heap grows this is the total over all regions.
+ * Kept equal to defaultHeap.size.
  */
-int allocsize;
+size_t allocsize;
 
 /*
  * Additional global variables may be added as needed below
  */
 
- 
-/* 
- * Function for allocating 'size' bytes of heap memory.
- * Argument size: requested size for the payload
- * Returns address of allocated block (payload) on success.
- * Returns NULL on failure.
+/*
+ * Free blocks that are large enough carry two links at the start of their
+ * payload and are kept on an explicit, doubly linked free list.  Which
+ * lists they go on depends on the index mode (MYHEAP_OPT_INDEX):
  *
- * This function must:
- * - Check size - Return NULL if not positive or if larger than heap space.
- * - Determine block size rounding up to a multiple of 8 
- *   and possibly adding padding as a result.
+ * MYHEAP_INDEX_SEGREGATED:
+ *   The lists are segregated into power-of-two size classes: class i holds
+ *   free blocks whose size is in [2^(i+4), 2^(i+5)).  Allocation searches
+ *   the request's class and the first non-empty class above it, which
+ *   gives an exact best fit.  Other placement policies can be chosen with
+ *   MYHEAP_OPT_PLACEMENT, see scanClass().
  *
- * - Use BEST-FIT PLACEMENT POLICY to chose a free block
+ * MYHEAP_INDEX_TLSF:
+ *   Two-level segregated fit.  The first level splits sizes by power of
+ *   two, the second level splits each power of two into TLSF_SL_COUNT
+ *   equal bins (sizes below TLSF_SMALL_SIZE get one bin per multiple of 8).
+ *   A bitmap of non-empty bins is kept for each level, so a fitting bin is
+ *   found with two find-first-set operations and no list is ever walked.
  *
- * - If the BEST-FIT block that is found is exact size match
- *   - 1. Update all heap blocks as needed for any affected blocks
- *   - 2. Return the address of the allocated block payload
+ *   To stay O(1) the request is rounded up to the next bin boundary, so
+ *   any block of the bin found fits.  The head of the request's own bin is
+ *   also tried first.  Fragmentation bound: next to the best fit among the
+ *   blocks that are at least the rounded-up size, the chosen block is
+ *   larger by less than one bin width, i.e. by less than 1/TLSF_SL_COUNT
+ *   (6.25%) of its size.  A closer fit that shares the request's own bin
+ *   but is not at its head may be passed over; such a block is itself at
+ *   most one bin width larger than the request.
  *
- * - If the BEST-FIT block that is found is large enough to split 
- *   - 1. SPLIT the free block into two valid heap blocks:
- *         1. an allocated block
- *         2. a free block
- *         NOTE: both blocks must meet heap block requirements 
- *       - Update all heap block header(s) and footer(s) 
- *              as needed for any affected blocks.
- *   - 2. Return the address of the allocated block payload
+ * Free blocks smaller than MIN_LINKED_SIZE (header + links + footer) cannot
+ * hold the links.  They still get a header and footer but are left off the
+ * lists until coalesce() merges them into a neighbour.
+ */
+typedef struct freeLinks {
+    blockHeader *next;
+    blockHeader *prev;
+} freeLinks;
+
+#define NUM_CLASSES 48
+#define DEFAULT_FIT_CANDIDATES 8  // blocks that fit looked at by MYHEAP_PLACE_GOOD
+#define PENDING_FREES 32          // queue length for MYHEAP_COALESCE_PENDING
+#define MIN_BLOCK_SIZE  (2 * sizeof(blockHeader))
+#define MIN_LINKED_SIZE \
+    ((2 * sizeof(blockHeader) + sizeof(freeLinks) + 7) / 8 * 8)
+
+#define TLSF_SL_LOG     4
+#define TLSF_SL_COUNT   (1 << TLSF_SL_LOG)
+#define TLSF_SMALL_LOG  (TLSF_SL_LOG + 3)
+#define TLSF_SMALL_SIZE (1 << TLSF_SMALL_LOG)
+#define TLSF_FL_COUNT   (64 - TLSF_SMALL_LOG + 1)
+
+typedef struct freeIndex {
+    int mode;
+    blockHeader *lists[NUM_CLASSES];
+    unsigned long flBitmap;
+    unsigned int slBitmap[TLSF_FL_COUNT];
+    blockHeader *bins[TLSF_FL_COUNT][TLSF_SL_COUNT];
+} freeIndex;
+
+/*
+ * Every mapping that holds heap blocks is described by a heapRegion.  The
+ * mapping made by myInit is described by firstRegion; the ones added when
+ * the heap grows (MYHEAP_OPT_GROW) keep their descriptor at the start of
+ * the mapping itself.  Each region begins with a block whose p-bit is set
+ * and ends with its own end mark, so blocks never merge across regions.
  *
- * - If a BEST-FIT block found is NOT found, return NULL
- *   Return NULL unable to find and allocate block for desired size
+ * Regions are only ever added, at the head of the list, after they are
+ * fully set up, so the list may be read without holding the heap's lock.
+ * Finding the region of an address goes through the ownership map, see
+ * ownerOf(), instead of the list.
  *
- * Note: payload address that is returned is NOT the address of the
- *       block header.  It is the address of the start of the 
- *       available memory for the requesterr.
+ * Regions are mapped from /dev/zero, or from anonymous memory with
+ * MYHEAP_OPT_HUGE_PAGES, so their memory starts out zeroed.
+ * highWater is the end of the highest block ever handed out.  A free
+ * block split off there has its header and links written at the mark,
+ * but further above it the only non-zero word is the footer in front of
+ * the end mark.  Pieces MYHEAP_OPT_CARVE_HIGH cuts from the top of free
+ * space do not raise the mark; carveLow is the lowest of them, less the
+ * footer written in front of it, and everything from there up may be
+ * dirty.  myCalloc relies on this to skip the memset in between.
+ */
+typedef struct heapRegion {
+    struct heapRegion *next;
+    myHeap_t *heap;          // heap the region belongs to
+    char *base;              // start of the mapping, page aligned
+    size_t mapSize;          // number of bytes mapped
+    blockHeader *first;      // first block of the region
+    blockHeader *endMark;    // end mark of the region
+    unsigned char *slabMap;  // one bit per slab sized unit, see isSlabPtr
+    char *highWater;         // nothing at or above it was ever handed out
+    char *carveLow;          // ...up to here, carve-high pieces lie above
+    int backing;             // MYHEAP_PAGES_* the mapping got
+    size_t pageSize;         // size of the pages backing it
+} heapRegion;
+
+#define SLAB_SIZE         4096
+#define SLAB_MAX_SIZE     128
+#define SLAB_CLASSES      (SLAB_MAX_SIZE / 8)
+
+/*
+ * Everything one heap owns.  defaultHeap is the heap of myInit, myAlloc
+ * and the other original functions; myHeapCreate makes more, each with
+ * its own lock, so threads using different heaps never contend.  Options
+ * are kept per heap, except for the thread caches, which only ever hold
+ * blocks of defaultHeap.
  *
- * Tips: Be careful with pointer arithmetic and scale factors.
+ * Functions that take a heap work on that heap alone.
  */
-void* myAlloc(int size) {     
-int blockSize;
-int memoryAvailable = -1;
-int trueSize;
-int previousBlock = 0;
-blockHeader *traverse = heapStart;
-blockHeader *block = NULL;
-if ((size <= 0)) { //Checks if the size is zero or negative
-    return NULL;
+struct myHeap {
+    pthread_mutex_t lock;      // serializes every access to its blocks and index
+    freeIndex index;           // its free blocks (MYHEAP_OPT_INDEX)
+    int coalesceMode;          // when free blocks merge (MYHEAP_OPT_COALESCE)
+    heapRegion *regions;       // may be read without the lock
+    heapRegion firstRegion;    // the mapping made when the heap was set up
+    size_t size;               // bytes over all regions
+    int growOn;                // map a new region instead of failing (MYHEAP_OPT_GROW)
+    int hugePagesOn;           // map regions on huge pages (MYHEAP_OPT_HUGE_PAGES)
+    size_t releaseThreshold;   // MYHEAP_OPT_RELEASE_THRESHOLD, see releaseFreePages()
+    int slabOn;                // MYHEAP_OPT_SLAB
+    struct slab *partialSlabs[SLAB_CLASSES]; // slabs with free slots, per class
+    struct hugeHeader *hugeBlocks;           // its directly mapped blocks
+    size_t mmapThreshold;      // MYHEAP_OPT_MMAP_THRESHOLD
+    int placement;             // MYHEAP_OPT_PLACEMENT, one of MYHEAP_PLACE_*
+    unsigned long fitCandidates; // MYHEAP_OPT_FIT_CANDIDATES, 0 for the default
+    size_t minRemainder;       // MYHEAP_OPT_MIN_REMAINDER, 0 for MIN_BLOCK_SIZE
+    size_t carveHigh;          // MYHEAP_OPT_CARVE_HIGH, 0 always carves the low end
+    blockHeader *rover;        // where MYHEAP_PLACE_NEXT carries on, may be NULL
+    blockHeader *pending[PENDING_FREES]; // freed blocks not yet merged (MYHEAP_COALESCE_PENDING)
+    int pendingCount;
+    heapRegion *cursorRegion;  // where coalesceStep() carries on
+    blockHeader *cursor;       // NULL to start a new pass
+    int numaNode;              // node its mappings are bound to, -1 for none
+    int hint;                  // MYHEAP_HINT_* of a heap made for myAllocHint, else 0
+    struct fileHeader *file;   // superblock of a heap from myHeapOpen, else NULL
+    int fileFd;                // that file, locked while it is open
+    void *remoteFrees;         // freed without the lock, see pushRemote(); atomic
+    size_t canarySecret;       // keys the header canaries, 0 for none, see canaryOf()
+    myStats_t stats;           // running counters, see myHeapStats()
+};
+
+static myHeap_t defaultHeap = { .lock = PTHREAD_MUTEX_INITIALIZER, .numaNode = -1 };
+
+/*
+ * Ownership map.
+ *
+ * One map, shared by every heap, tells what owns an address.  It is a
+ * radix tree over page numbers, three levels of OWNER_BITS each with
+ * 4 KiB pages, so it covers the 48-bit addresses Linux hands out unless
+ * asked for more.  Each page of a region maps to its heapRegion, and the
+ * page holding the payload of a huge block maps to its hugeHeader with
+ * OWNER_HUGE added.  Both name their heap, so findRegion(), findHuge()
+ * and ownerHeap() are three loads and take no lock.
+ *
+ * Entries are published with release stores after what they point to is
+ * set up.  Updates are serialized by ownerLock, and nodes are mapped on
+ * first use and never unmapped, so a reader never sees one disappear.
+ */
+#define OWNER_PAGE_SHIFT 12
+#define OWNER_BITS       12
+#define OWNER_FANOUT     (1UL << OWNER_BITS)
+#define OWNER_HUGE       1 // added to a hugeHeader in the map
+
+static void *ownerRoot[OWNER_FANOUT];
+static pthread_mutex_t ownerLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Returns the node 'slot' points at, mapping it first if 'create' is not
+ * zero.  Returns NULL if there is none or it cannot be mapped.
+ */
+static void **ownerNode(void **slot, int create) {
+    void **node = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+
+    if (node == NULL && create) {
+        node = mmap(NULL, OWNER_FANOUT * sizeof(void *), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (MAP_FAILED == node) {
+            return NULL;
+        }
+        __atomic_store_n(slot, node, __ATOMIC_RELEASE);
+    }
+    return node;
 }
-size = sizeof(blockHeader) + size;
-if (size % 8 != 0) { //Checks if padding is required
-    size = size + 8 - (size % 8);
+
+/*
+ * Returns the leaf of the map that holds the entry of 'page', as for
+ * ownerNode().
+ */
+static void **ownerLeaf(uintptr_t page, int create) {
+    void **mid = ownerNode(&ownerRoot[page >> (2 * OWNER_BITS)], create);
+
+    if (mid == NULL) {
+        return NULL;
+    }
+    return ownerNode(&mid[(page >> OWNER_BITS) & (OWNER_FANOUT - 1)], create);
 }
-if (allocsize < size) { //Checks if size is greater than heap
-    return NULL;
+
+/*
+ * Returns the map entry of the page holding 'ptr', or NULL if nothing
+ * owns it.
+ */
+static void *ownerOf(void *ptr) {
+    uintptr_t page = (uintptr_t)ptr >> OWNER_PAGE_SHIFT;
+    void **leaf;
+
+    if (page >> (3 * OWNER_BITS) != 0 || (leaf = ownerLeaf(page, 0)) == NULL) {
+        return NULL;
+    }
+    return __atomic_load_n(&leaf[page & (OWNER_FANOUT - 1)], __ATOMIC_ACQUIRE);
 }
-while (traverse->size_status != 1) {
-    blockSize = traverse->size_status;
-    trueSize = blockSize;
-    if (traverse->size_status & 1) {
-        trueSize -= 1;
-    }
-    if (traverse->size_status & 2) {
-        trueSize -= 2;
-    }
-    if (blockSize % 2 == 0) {
-        if ((trueSize >= size) &&
-            ((memoryAvailable == -1) || (memoryAvailable > trueSize))) {
-            memoryAvailable = trueSize;
-            block = traverse;
-            if (traverse->size_status & 2) {
-                previousBlock = 2;
-            } else {
-                previousBlock = 0;
-            }
+
+/*
+ * Sets the map entries of the pages from 'start' to 'start + length' to
+ * 'owner', or clears them if 'owner' is NULL.  Returns 0 on success, -1
+ * if the pages are out of the map's reach or a node cannot be mapped, in
+ * which case no entry is left set.
+ */
+static int setOwner(char *start, size_t length, void *owner) {
+    uintptr_t first = (uintptr_t)start >> OWNER_PAGE_SHIFT;
+    uintptr_t last = ((uintptr_t)start + length - 1) >> OWNER_PAGE_SHIFT;
+    uintptr_t page;
+
+    if (last >> (3 * OWNER_BITS) != 0) {
+        return -1;
+    }
+    pthread_mutex_lock(&ownerLock);
+    for (page = first; page <= last; page++) {
+        void **leaf = ownerLeaf(page, owner != NULL);
+        if (leaf == NULL && owner != NULL) {
+            break;
+        }
+        if (leaf == NULL) { // never set, skip the rest of the leaf
+            page |= OWNER_FANOUT - 1;
+            continue;
+        }
+        __atomic_store_n(&leaf[page & (OWNER_FANOUT - 1)], owner, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&ownerLock);
+    if (page <= last) {
+        if (page > first) {
+            setOwner(start, (page - first) << OWNER_PAGE_SHIFT, NULL);
         }
+        return -1;
     }
-    traverse = (blockHeader *)((char *)traverse + trueSize);
+    return 0;
 }
-if (memoryAvailable > size) {
-    block->size_status = size + previousBlock + 1;
-    blockHeader *sp = (blockHeader *)((char *)block + size);
-    if (sp->size_status == 1) {
-        return ((char *)block + 4);
+
+/*
+ * Returns the region of 'heap' whose blocks contain 'ptr', or NULL if
+ * 'ptr' is not inside any of its regions.
+ */
+static heapRegion *findRegion(myHeap_t *heap, void *ptr) {
+    heapRegion *region = ownerOf(ptr);
+
+    if (region == NULL || ((uintptr_t)region & OWNER_HUGE) != 0 || region->heap != heap) {
+        return NULL;
     }
-    sp->size_status = memoryAvailable - size + 2;
-    return ((char *)block + 4);
-} else if (memoryAvailable == size) {
-    block->size_status += 1;
-    blockHeader *sp = (blockHeader *)((char *)block + size);
-    if (sp->size_status == 1) {
-        return ((char *)block + 4);
+    if ((char *)ptr > (char *)region->first && (char *)ptr < (char *)region->endMark) {
+        return region;
     }
-    sp->size_status += 2;
-    return ((char *)block + 4);
+    return NULL;
 }
-return NULL;
-} 
- 
-/* 
- * Function for freeing up a previously allocated block.
- * Argument ptr: address of the block to be freed up.
- * Returns 0 on success.
- * Returns -1 on failure.
- * This function should:
- * - Return -1 if ptr is NULL.
- * - Return -1 if ptr is not a multiple of 8.
- * - Return -1 if ptr is outside of the heap space.
- * - Return -1 if ptr block is already freed.
- * - Update header(s) and footer as needed.
- */                    
-int myFree(void *ptr) {    
-if (ptr == NULL) {
-    return -1;
+
+/*
+ * Counts an allocation that succeeded if 'ok' is not zero, or failed.
+ * Caller must hold the heap's lock.
+ */
+static void countResult(myHeap_t *heap, int ok) {
+    if (ok) {
+        heap->stats.allocs++;
+    } else {
+        heap->stats.failedAllocs++;
+    }
 }
-if (((unsigned int)ptr) % 8 != 0) { //Checks padding
-    return -1;
+
+/*
+ * Counts an allocation that fails before the lock is taken.
+ */
+static void countFailure(myHeap_t *heap) {
+    pthread_mutex_lock(&heap->lock);
+    heap->stats.failedAllocs++;
+    pthread_mutex_unlock(&heap->lock);
 }
-if ((unsigned int)heapStart > (unsigned int)ptr) { //Checks if the pointer initialized is smaller than the first block of memory
-    return -1;
+
+/*
+ * Header and footer words are read by isLive() without the lock, and
+ * bit2 of an allocated header is set by markRemote() without it, so they
+ * are only ever loaded and stored atomically, if relaxed.
+ */
+static size_t statusOf(blockHeader *block) {
+    return __atomic_load_n(&block->size_status, __ATOMIC_RELAXED);
 }
-if (((blockHeader *)((char *)ptr - 4))->size_status % 2 != 1) { //Checks if the block has already been freed
-    return -1;
+
+/*
+ * Stores a header or footer word, see statusOf().
+ */
+static void setStatus(blockHeader *block, size_t status) {
+    __atomic_store_n(&block->size_status, status, __ATOMIC_RELAXED);
 }
-blockHeader *currentBlock = (blockHeader *)((char *)ptr - 4);
-(currentBlock->size_status) -= 1;
-int currBlock_size = (currentBlock->size_status / 8) * 8;
-blockHeader *footer =
-    (blockHeader *)((char *)currentBlock + currBlock_size - 4);
-footer->size_status = currBlock_size;
-blockHeader *nextBlock =
-    (blockHeader *)((char *)currentBlock + (currentBlock->size_status / 8) * 8);
-if (nextBlock->size_status != 1) {
-    nextBlock->size_status -= 2;
+
+/*
+ * Header canaries (MYHEAP_HARDENED).
+ *
+ * Sizes stay below 2^48, so a hardened build keeps a canary in the top
+ * 16 bits of every allocated header in a region, a hash of the block's
+ * offset into its region keyed by a secret drawn when the heap is made.
+ * isLive() refuses a header whose canary does not match, so a free of a
+ * pointer into the middle of a block, or of one whose header an overrun
+ * has written over, fails instead of breaking the heap.  Free blocks,
+ * slab slots and huge blocks carry none.  Release builds neither write
+ * nor mask the bits.  A heap file keeps its secret, and one made by a
+ * hardened build is only opened by one.
+ */
+#define HEADER_CANARY (~(size_t)0 << 48)
+
+#ifdef MYHEAP_HARDENED
+#define STATUS_BITS (HEADER_CANARY | 7)
+#else
+#define STATUS_BITS ((size_t)7)
+#endif
+
+/*
+ * Returns the size of a block with the status bits masked out.
+ */
+static size_t blockSize(blockHeader *block) {
+    return statusOf(block) & ~STATUS_BITS;
 }
 
-return 0;
-} 
- 
- 
+/*
+ * Returns a secret for the header canaries of a new heap, 0 in release
+ * builds, which write none.
+ */
+static size_t newCanarySecret(void) {
+#ifdef MYHEAP_HARDENED
+    size_t secret = 0;
+    if (syscall(SYS_getrandom, &secret, sizeof(secret), 0) != (long)sizeof(secret)) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        secret = (size_t)now.tv_nsec * 0x9E3779B97F4A7C15UL ^ (uintptr_t)&now;
+    }
+    return secret | 1;
+#else
+    return 0;
+#endif
+}
 
+#ifdef MYHEAP_HARDENED
 /*
- * Function for traversing heap block list and coalescing all adjacent 
- * free blocks.
+ * Returns the canary bits an allocated header at 'block' in 'region'
+ * has, 0 if its heap has no secret.
+ */
+static size_t canaryOf(heapRegion *region, blockHeader *block) {
+    size_t secret = region->heap->canarySecret;
+
+    if (secret == 0) {
+        return 0;
+    }
+    return (((uintptr_t)block - (uintptr_t)region->base) ^ secret) * 0x9E3779B97F4A7C15UL & HEADER_CANARY;
+}
+#endif
+
+/*
+ * Returns the canary bits to add to the header of 'block' of 'heap' as
+ * it is marked allocated; none in release builds.
+ */
+static size_t newCanary(myHeap_t *heap, blockHeader *block) {
+#ifdef MYHEAP_HARDENED
+    return canaryOf(findRegion(heap, block + 1), block);
+#else
+    (void)heap;
+    (void)block;
+    return 0;
+#endif
+}
+
+/*
+ * Returns the links stored in the payload of a free block.
+ */
+static freeLinks *linksOf(blockHeader *block) {
+    return (freeLinks *)((char *)block + sizeof(blockHeader));
+}
+
+/*
+ * Returns the size class a block of 'size' bytes is listed under.
+ */
+static int sizeClass(size_t size) {
+    int class = 0;
+    size >>= 5;
+    while (size != 0 && class < NUM_CLASSES - 1) {
+        size >>= 1;
+        class++;
+    }
+    return class;
+}
+
+/*
+ * Computes the TLSF first- and second-level bin of a block of 'size' bytes.
+ */
+static void tlsfMapping(size_t size, int *fl, int *sl) {
+    if (size < TLSF_SMALL_SIZE) {
+        *fl = 0;
+        *sl = size / 8;
+    } else {
+        int log2 = 63 - __builtin_clzl(size);
+        *fl = log2 - TLSF_SMALL_LOG + 1;
+        *sl = (size >> (log2 - TLSF_SL_LOG)) - TLSF_SL_COUNT;
+    }
+}
+
+/*
+ * Returns the list head a free block of 'size' bytes belongs on.
+ */
+static blockHeader **listHead(myHeap_t *heap, size_t size) {
+    if (heap->index.mode == MYHEAP_INDEX_TLSF) {
+        int fl, sl;
+        tlsfMapping(size, &fl, &sl);
+        return &heap->index.bins[fl][sl];
+    }
+    return &heap->index.lists[sizeClass(size)];
+}
+
+/*
+ * Pushes a free block onto the front of its list.
+ * Blocks too small to hold the links are not listed.
+ */
+static void insertFree(myHeap_t *heap, blockHeader *block) {
+    size_t size = blockSize(block);
+    if (size < MIN_LINKED_SIZE) {
+        return;
+    }
+    blockHeader **head = listHead(heap, size);
+    freeLinks *links = linksOf(block);
+    links->prev = NULL;
+    links->next = *head;
+    if (*head != NULL) {
+        linksOf(*head)->prev = block;
+    }
+    *head = block;
+    if (heap->index.mode == MYHEAP_INDEX_TLSF) {
+        int fl, sl;
+        tlsfMapping(size, &fl, &sl);
+        heap->index.flBitmap |= 1UL << fl;
+        heap->index.slBitmap[fl] |= 1U << sl;
+    }
+}
+
+/*
+ * Unlinks a free block from its list.
+ * Must be called while the header still holds the size it was listed with.
+ */
+static void removeFree(myHeap_t *heap, blockHeader *block) {
+    size_t size = blockSize(block);
+    if (size < MIN_LINKED_SIZE) {
+        return;
+    }
+    freeLinks *links = linksOf(block);
+    if (block == heap->rover) {
+        heap->rover = links->next;
+    }
+    if (links->prev != NULL) {
+        linksOf(links->prev)->next = links->next;
+    } else {
+        blockHeader **head = listHead(heap, size);
+        *head = links->next;
+        if (*head == NULL && heap->index.mode == MYHEAP_INDEX_TLSF) {
+            int fl, sl;
+            tlsfMapping(size, &fl, &sl);
+            heap->index.slBitmap[fl] &= ~(1U << sl);
+            if (heap->index.slBitmap[fl] == 0) {
+                heap->index.flBitmap &= ~(1UL << fl);
+            }
+        }
+    }
+    if (links->next != NULL) {
+        linksOf(links->next)->prev = links->prev;
+    }
+}
+
+/*
+ * Writes the footer of a free block from the size in its header.
+ */
+static void writeFooter(blockHeader *block) {
+    size_t size = blockSize(block);
+    setStatus((blockHeader *)((char *)block + size - sizeof(blockHeader)), size);
+}
+
+/*
+ * Returns the block that follows 'block' in the heap.
+ */
+static blockHeader *nextBlockOf(blockHeader *block) {
+    return (blockHeader *)((char *)block + blockSize(block));
+}
+
+/*
+ * Returns 1 if 'block' is free, 0 if it is allocated or the end mark.
+ */
+static int isFreeBlock(blockHeader *block) {
+    return statusOf(block) % 2 == 0;
+}
+
+/*
+ * Sets the p-bit of 'block' if 'allocated', else clears it; the end mark
+ * is left alone.  The update is atomic, as markRemote() may set bit2 of
+ * an allocated block without the lock at the same time.
+ */
+static void setPrevAllocated(blockHeader *block, int allocated) {
+    if (statusOf(block) == 1) {
+        return;
+    }
+    if (allocated) {
+        __atomic_fetch_add(&block->size_status, 2, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_sub(&block->size_status, 2, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Called after 'block' has grown over the blocks behind it.  The
+ * coalescing cursor and pending frees that pointed at one of those now
+ * point at 'block', so they always point at a block header.
+ */
+static void mergedInto(myHeap_t *heap, blockHeader *block) {
+    char *end = (char *)block + blockSize(block);
+    int i;
+
+    if ((char *)heap->cursor > (char *)block && (char *)heap->cursor < end) {
+        heap->cursor = block;
+    }
+    for (i = 0; i < heap->pendingCount; i++) {
+        if ((char *)heap->pending[i] > (char *)block && (char *)heap->pending[i] < end) {
+            heap->pending[i] = block;
+        }
+    }
+}
+
+/*
+ * Merges the free block that follows 'block' into it.
+ * Both blocks must already be off the free lists; the caller relists
+ * 'block' and writes its footer once it is done merging.
+ */
+static void absorbNext(myHeap_t *heap, blockHeader *block) {
+    blockHeader *next = nextBlockOf(block);
+    removeFree(heap, next);
+    // The merged block is no longer released as a whole
+    setStatus(block, (statusOf(block) & ~(size_t)4) + blockSize(next));
+    mergedInto(heap, block);
+}
+
+/*
+ * Merges an unlisted free block with its free neighbours in O(1).
+ * The following block is found from the size in the header; a clear p-bit
+ * says the previous block is free and its footer holds its size.
+ * Returns the header of the merged block, which is not listed yet and
+ * has no valid footer.
+ */
+static blockHeader *mergeNeighbours(myHeap_t *heap, blockHeader *block) {
+    if (isFreeBlock(nextBlockOf(block))) {
+        absorbNext(heap, block);
+    }
+    if ((statusOf(block) & 2) == 0) {
+        size_t prevSize = statusOf((blockHeader *)((char *)block - sizeof(blockHeader)));
+        blockHeader *prev = (blockHeader *)((char *)block - prevSize);
+        removeFree(heap, prev);
+        setStatus(prev, (statusOf(prev) & ~(size_t)4) + blockSize(block));
+        block = prev;
+        mergedInto(heap, block);
+    }
+    return block;
+}
+
+/*
+ * Merges each block on the pending-free queue (MYHEAP_COALESCE_PENDING)
+ * that is still free with its free neighbours, and empties the queue.
+ * Caller must hold the heap's lock.
+ */
+static void drainPending(myHeap_t *heap) {
+    while (heap->pendingCount > 0) {
+        blockHeader *block = heap->pending[--heap->pendingCount];
+        if (!isFreeBlock(block)) {
+            continue; // allocated again since
+        }
+        removeFree(heap, block);
+        block = mergeNeighbours(heap, block);
+        writeFooter(block);
+        insertFree(heap, block);
+    }
+}
+
+/*
+ * Picks a listed free block of at least 'size' bytes from one class under
+ * the heap's placement policy (MYHEAP_OPT_PLACEMENT), or returns NULL if
+ * none of its blocks fits.
  *
- * This function is used for delayed coalescing.
- * Updated header size_status and footer size_status as needed.
+ * No block of the class is smaller than its lower bound, so best fit
+ * stops as soon as it meets a block of the request's size or of that
+ * bound.  First fit and next fit stop at the first block that fits; next
+ * fit starts at the roving pointer if it lies in this class and wraps
+ * round to the head.  Good fit keeps the smallest of the first
+ * fitCandidates blocks that fit.
  */
-int coalesce() {
-int temporarySize = 0;
+static blockHeader *scanClass(myHeap_t *heap, int class, size_t size) {
+    blockHeader *head = heap->index.lists[class];
+    blockHeader *start = head;
+    blockHeader *best = NULL;
+    blockHeader *traverse;
+    size_t lowest = class == 0 ? 0 : (size_t)16 << class;
+    size_t target = size > lowest ? size : lowest;
+    unsigned long limit = (unsigned long)-1; // fitting blocks to look at
+    unsigned long found = 0;
+    unsigned long scanned = 0;
+    int wrapped = 0;
 
-blockHeader *currentBlock = heapStart;
+    if (heap->placement == MYHEAP_PLACE_FIRST || heap->placement == MYHEAP_PLACE_NEXT) {
+        limit = 1;
+    } else if (heap->placement == MYHEAP_PLACE_GOOD) {
+        limit = heap->fitCandidates != 0 ? heap->fitCandidates : DEFAULT_FIT_CANDIDATES;
+    }
+    if (heap->placement == MYHEAP_PLACE_NEXT && heap->rover != NULL &&
+        sizeClass(blockSize(heap->rover)) == class) {
+        start = heap->rover;
+    }
 
-blockHeader *blockFooter;
+    for (traverse = start; traverse != NULL;) {
+        size_t trueSize = blockSize(traverse);
+        scanned++;
+        if (trueSize >= size) {
+            if (best == NULL || trueSize < blockSize(best)) {
+                best = traverse;
+            }
+            if (++found == limit || trueSize == target) {
+                break;
+            }
+        }
+        traverse = linksOf(traverse)->next;
+        if (traverse == NULL && !wrapped && start != head) {
+            traverse = head;
+            wrapped = 1;
+        }
+        if (wrapped && traverse == start) {
+            break;
+        }
+    }
+    heap->stats.blocksScanned += scanned;
+    return best;
+}
 
-while (currentBlock->size_status != 1) {
-    if (currentBlock->size_status % 2 == 0) //Checks if the block is free or not
-    {
-        blockHeader *nextBlock =  (blockHeader *)((char *)currentBlock +  (currentBlock->size_status / 8) * 8);
+/*
+ * Returns a listed free block of at least 'size' bytes, or NULL if there
+ * is none.  With MYHEAP_PLACE_BEST it is the smallest such block.
+ *
+ * Only the class 'size' falls in can hold blocks that are too small, so
+ * it is searched first.  Every block in a higher class fits, and all of
+ * them are larger than anything in the classes below, so only the first
+ * non-empty higher class is searched after it.
+ */
+static blockHeader *findListFit(myHeap_t *heap, size_t size) {
+    int class;
+    blockHeader *block = NULL;
 
-        if (nextBlock->size_status % 2 == 0 && nextBlock->size_status != 1)
-        {
-            currentBlock->size_status += (nextBlock->size_status / 8) * 8;
-            temporarySize = (currentBlock->size_status / 8) * 8;
-            blockFooter = ((blockHeader *)((char *)currentBlock + temporarySize - 4));
-            blockFooter->size_status = temporarySize;
+    for (class = sizeClass(size); block == NULL && class < NUM_CLASSES; class++) {
+        if (heap->index.lists[class] != NULL) {
+            block = scanClass(heap, class, size);
         }
+    }
+    if (block != NULL && heap->placement == MYHEAP_PLACE_NEXT) {
+        heap->rover = linksOf(block)->next;
+    }
+    return block;
+}
 
-        if ((currentBlock->size_status) % 8 == 0) {
-            int p_bit = ((blockHeader *)((char *)currentBlock - 4))->size_status;
-            blockHeader *p = (blockHeader *)((char *)currentBlock - p_bit);
-            p->size_status += (currentBlock->size_status / 8) * 8;
-            temporarySize = (p->size_status / 8) * 8;
-            blockFooter = ((blockHeader *)((char *)p + temporarySize - 4));
-            blockFooter->size_status = temporarySize;
+/*
+ * TLSF counterpart of findListFit(), see the fragmentation bound above.
+ * Runs in constant time: one list head and two bitmap searches.
+ */
+static blockHeader *findGoodFit(myHeap_t *heap, size_t size) {
+    size_t rounded = size;
+    unsigned int slMap;
+    unsigned long flMap;
+    int fl, sl;
+
+    tlsfMapping(size, &fl, &sl);
+    if (heap->index.bins[fl][sl] != NULL) {
+        heap->stats.blocksScanned++;
+        if (blockSize(heap->index.bins[fl][sl]) >= size) {
+            return heap->index.bins[fl][sl];
         }
     }
 
-    currentBlock = (blockHeader *)((char *)currentBlock + (currentBlock->size_status / 8) * 8);
+    if (rounded >= TLSF_SMALL_SIZE) {
+        rounded += (1UL << (63 - __builtin_clzl(rounded) - TLSF_SL_LOG)) - 1;
+        if (rounded < size) {
+            return NULL;
+        }
+    }
+    tlsfMapping(rounded, &fl, &sl);
+    if (fl >= TLSF_FL_COUNT) {
+        return NULL;
+    }
+    slMap = heap->index.slBitmap[fl] & (~0U << sl);
+    if (slMap == 0) {
+        flMap = fl + 1 < TLSF_FL_COUNT ? heap->index.flBitmap & (~0UL << (fl + 1)) : 0;
+        if (flMap == 0) {
+            return NULL;
+        }
+        fl = __builtin_ctzl(flMap);
+        slMap = heap->index.slBitmap[fl];
+    }
+    heap->stats.blocksScanned++;
+    return heap->index.bins[fl][__builtin_ctz(slMap)];
 }
 
-return 0; 
+/*
+ * Empties the index and relists every free block in the heap.
+ * Used when the index mode changes after myInit.
+ */
+static void rebuildIndex(myHeap_t *heap) {
+    int mode = heap->index.mode;
+    heapRegion *region;
+    blockHeader *current;
+
+    memset(&heap->index, 0, sizeof(heap->index));
+    heap->index.mode = mode;
+    heap->rover = NULL;
+    for (region = heap->regions; region != NULL; region = region->next) {
+        for (current = region->first; statusOf(current) != 1;
+             current = nextBlockOf(current)) {
+            if (statusOf(current) % 2 == 0) {
+                insertFree(heap, current);
+            }
+        }
+    }
 }
 
+/*
+ * Binds a mapping that has not been touched yet to NUMA node 'node'
+ * (MPOL_BIND).  Nothing happens if the kernel cannot do it.
+ */
+#define NUMA_MPOL_BIND 2
+#define MAX_NODES      64
+
+static void bindNode(void *base, size_t size, int node) {
+    unsigned long mask = 1UL << node;
+
+    syscall(SYS_mbind, base, size, NUMA_MPOL_BIND, &mask, MAX_NODES + 1, 0);
+}
+
+/*
+ * Opens /dev/zero and maps 'size' bytes of it, so the memory starts out
+ * zeroed.  Returns the start of the mapping, or NULL on failure.
+ */
+static void *mapZeroed(size_t size) {
+    int fd = open("/dev/zero", O_RDWR);
+    void *mmap_ptr;
+
+    if (-1 == fd) {
+        return NULL;
+    }
+    mmap_ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    return MAP_FAILED == mmap_ptr ? NULL : mmap_ptr;
+}
+
+#define HUGE_PAGE_SIZE (2UL << 20)
+
+/*
+ * Maps 'size' bytes (a multiple of HUGE_PAGE_SIZE) of zeroed memory on
+ * huge pages.  Explicit huge pages from MAP_HUGETLB are tried first.  If
+ * none are reserved, anonymous memory aligned to HUGE_PAGE_SIZE is
+ * mapped instead and marked MADV_HUGEPAGE for transparent huge pages.
+ * Stores the MYHEAP_PAGES_* that was obtained in 'backing'.
+ * Returns the mapping, or NULL on failure.
+ */
+static void *mapHuge(size_t size, int *backing) {
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    char *base;
+    size_t front;
+
+#ifdef MAP_HUGE_SHIFT
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB | (21 << MAP_HUGE_SHIFT), -1, 0);
+#else
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+#endif
+    if (MAP_FAILED != base) {
+        *backing = MYHEAP_PAGES_HUGETLB;
+        return base;
+    }
+
+    // Map one huge page more and drop what is outside the aligned part
+    base = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (MAP_FAILED == base) {
+        return NULL;
+    }
+    front = -(uintptr_t)base & (HUGE_PAGE_SIZE - 1);
+    if (front != 0) {
+        munmap(base, front);
+    }
+    munmap(base + front + size, HUGE_PAGE_SIZE - front);
+    base += front;
+    *backing = madvise(base, size, MADV_HUGEPAGE) == 0 ? MYHEAP_PAGES_TRANSPARENT
+                                                       : MYHEAP_PAGES_SMALL;
+    return base;
+}
+
+/*
+ * Describes the mapping of 'mapSize' bytes at 'base', whose blocks run
+ * from 'first' to the end mark in its last 8 bytes, enters its pages in
+ * the ownership map and publishes it at the head of the region list.
+ * Returns 0 on success, -1 if the map cannot take the pages.
+ */
+static int linkRegion(myHeap_t *heap, heapRegion *region, char *base, size_t mapSize,
+                      blockHeader *first, int backing) {
+    region->heap = heap;
+    region->base = base;
+    region->mapSize = mapSize;
+    region->backing = backing;
+    region->pageSize = backing != MYHEAP_PAGES_SMALL ? HUGE_PAGE_SIZE : (size_t)getpagesize();
+    region->first = first;
+    region->endMark = (blockHeader *)(base + mapSize - sizeof(blockHeader));
+    region->slabMap = NULL;
+    region->highWater = (char *)first;
+    region->carveLow = (char *)region->endMark;
+    if (setOwner(base, mapSize, region) != 0) {
+        return -1;
+    }
+    region->next = heap->regions;
+    __atomic_store_n(&heap->regions, region, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Turns a fresh mapping into a region of 'heap' described by 'region':
+ * one free block from 'offset' up to an end mark at the end of the
+ * mapping.  Returns 0 on success, -1 if linkRegion() fails, in which
+ * case the heap is left as it was.
+ */
+static int formatRegion(myHeap_t *heap, heapRegion *region, char *base, size_t mapSize,
+                        size_t offset, int backing) {
+    blockHeader *first = (blockHeader *)(base + offset);
+    size_t freeSize = mapSize - offset - sizeof(blockHeader);
+
+    setStatus((blockHeader *)((char *)first + freeSize), 1);
+    setStatus(first, freeSize + 2); // nothing in front, so p-bit set
+    writeFooter(first);
+    if (linkRegion(heap, region, base, mapSize, first, backing) != 0) {
+        return -1;
+    }
+    insertFree(heap, first);
+    // Allocations compare against the size before taking the lock
+    __atomic_store_n(&heap->size, heap->size + freeSize, __ATOMIC_RELAXED);
+    if (heap == &defaultHeap) {
+        allocsize = heap->size;
+    }
+    return 0;
+}
+
+/*
+ * Maps a new region with room for a block of at least 'size' bytes.  The
+ * region is at least as large as the heap already is, so the heap doubles
+ * and the number of regions stays logarithmic in its size.
+ * Returns 0 on success, -1 if the memory cannot be mapped.
+ * Caller must hold the heap's lock.
+ */
+static int growHeap(myHeap_t *heap, size_t size) {
+    size_t pagesize = getpagesize();
+    size_t offset = (sizeof(heapRegion) + 7) / 8 * 8; // keeps payloads 8-aligned
+    size_t mapSize;
+    int backing = MYHEAP_PAGES_SMALL;
+    char *base;
+
+    if (size > SIZE_MAX / 2) {
+        return -1;
+    }
+    mapSize = size + offset + sizeof(blockHeader);
+    if (mapSize < heap->size) {
+        mapSize = heap->size;
+    }
+    if (heap->hugePagesOn) {
+        mapSize = (mapSize + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        base = mapHuge(mapSize, &backing);
+    } else {
+        mapSize = (mapSize + pagesize - 1) / pagesize * pagesize;
+        base = mapZeroed(mapSize);
+    }
+    if (base == NULL) {
+        return -1;
+    }
+    if (heap->numaNode >= 0) {
+        bindNode(base, mapSize, heap->numaNode);
+    }
+    if (formatRegion(heap, (heapRegion *)base, base, mapSize, offset, backing) != 0) {
+        munmap(base, mapSize);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Returns a listed free block of at least 'size' bytes using the current
+ * index mode, or NULL if there is none.
+ */
+static blockHeader *searchIndex(myHeap_t *heap, size_t size) {
+    heap->stats.searches++;
+    if (heap->index.mode == MYHEAP_INDEX_TLSF) {
+        return findGoodFit(heap, size);
+    }
+    return findListFit(heap, size);
+}
+
+/*
+ * Like searchIndex(), but grows the heap first if there is no block and
+ * growth is on.  Returns NULL if no block can be found.
+ */
+static blockHeader *findFit(myHeap_t *heap, size_t size) {
+    int attempt;
+
+    for (attempt = 0; attempt < 2; attempt++) {
+        blockHeader *block = searchIndex(heap, size);
+        if (block != NULL || !heap->growOn || growHeap(heap, size) != 0) {
+            return block;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Raises the high-water mark of the region holding 'block', which is
+ * about to be handed out.  Caller must hold the heap's lock.
+ */
+static void touchRegion(myHeap_t *heap, blockHeader *block) {
+    heapRegion *region = findRegion(heap, block + 1);
+    char *end = (char *)block + blockSize(block);
+
+    if (end > region->highWater) {
+        region->highWater = end;
+    }
+}
+
+/*
+ * Returns the smallest block a split may leave behind: a header and a
+ * footer, or more with MYHEAP_OPT_MIN_REMAINDER.
+ */
+static size_t minRemainder(myHeap_t *heap) {
+    return heap->minRemainder > MIN_BLOCK_SIZE ? heap->minRemainder : MIN_BLOCK_SIZE;
+}
+
+/*
+ * Marks an unlisted free block allocated with 'size' bytes (already
+ * padded, header included), splitting off the rest as a new free block
+ * when it is at least minRemainder() bytes.  A smaller rest is handed
+ * out with the block.
+ */
+static void placeBlock(myHeap_t *heap, blockHeader *block, size_t size) {
+    size_t memoryAvailable = blockSize(block);
+    size_t released = statusOf(block) & 4;
+
+    if (memoryAvailable >= size + minRemainder(heap)) {
+        // Split: the remainder keeps the free status and gets its own footer
+        setStatus(block, size + (statusOf(block) & 2) + 1 + newCanary(heap, block));
+        blockHeader *sp = (blockHeader *)((char *)block + size);
+        setStatus(sp, memoryAvailable - size + 2 + released);
+        writeFooter(sp);
+        insertFree(heap, sp);
+    } else {
+        setStatus(block, (statusOf(block) & ~(size_t)4) + 1 + newCanary(heap, block));
+        setPrevAllocated(nextBlockOf(block), 1);
+    }
+    heap->stats.usedBytes += blockSize(block);
+    touchRegion(heap, block);
+}
+
+/*
+ * Like placeBlock(), but a request below MYHEAP_OPT_CARVE_HIGH bytes is
+ * cut from the high end of the block, so that small blocks gather at the
+ * top of free space and the low end stays whole for large ones.  The rest
+ * keeps the block's address, p-bit and released mark.  Returns the
+ * allocated block.  Caller must hold the heap's lock.
+ */
+static blockHeader *placeFit(myHeap_t *heap, blockHeader *block, size_t size) {
+    size_t memoryAvailable = blockSize(block);
+    heapRegion *region;
+    blockHeader *piece;
+
+    if (size >= heap->carveHigh || memoryAvailable < size + minRemainder(heap)) {
+        placeBlock(heap, block, size);
+        return block;
+    }
+    setStatus(block, statusOf(block) - size);
+    writeFooter(block);
+    insertFree(heap, block);
+    piece = (blockHeader *)((char *)block + memoryAvailable - size);
+    setStatus(piece, size + 1 + newCanary(heap, piece)); // p-bit clear, the rest in front is free
+    setPrevAllocated(nextBlockOf(piece), 1);
+    heap->stats.usedBytes += size;
+    // Lower the carve mark instead of raising the high-water mark over
+    // the untouched rest of the block, the rest's footer included
+    region = findRegion(heap, piece + 1);
+    if ((char *)block + blockSize(block) - sizeof(blockHeader) < region->carveLow) {
+        region->carveLow = (char *)block + blockSize(block) - sizeof(blockHeader);
+    }
+    return piece;
+}
+
+/*
+ * Takes a free block of at least 'size' bytes (already padded, header
+ * included) off the index and marks it allocated, splitting off the rest
+ * as a new free block.  Returns the block header, or NULL if no free
+ * block is large enough.  Caller must hold the heap's lock.
+ */
+static blockHeader *allocBlock(myHeap_t *heap, size_t size) {
+    blockHeader *block = findFit(heap, size);
+
+    if (block == NULL) {
+        return NULL;
+    }
+    removeFree(heap, block);
+    return placeFit(heap, block, size);
+}
+
+/*
+ * Returns the size of a free block that can hold a block of 'size' bytes
+ * aligned to 'align', wherever the free block lies.
+ */
+static size_t alignedFitSize(size_t size, size_t align) {
+    return align <= 8 ? size : size + align + MIN_BLOCK_SIZE - 8;
+}
+
+/*
+ * Like placeFit(), for a block of 'size' bytes at whose address plus
+ * 'skew' a multiple of 'align' (a power of two) starts: the payload for
+ * a skew of sizeof(blockHeader), the header itself for 0.  'block' must
+ * be off the index and at least alignedFitSize() bytes.  The space in
+ * front of the aligned block is split off as a free block of its own;
+ * both parts stay released if the block was.  Headers sit on a multiple
+ * of 8, so the gap is a multiple of 8 as well; a gap of 8 is too small
+ * to be a block, so the next aligned address is used instead.
+ * Returns the header of the aligned block.
+ * Caller must hold the heap's lock.
+ */
+static blockHeader *placeAligned(myHeap_t *heap, blockHeader *block, size_t size, size_t align,
+                                 size_t skew) {
+    size_t gap;
+
+    if (align <= 8) {
+        return placeFit(heap, block, size);
+    }
+    gap = -(uintptr_t)((char *)block + skew) & (align - 1);
+    if (gap != 0 && gap < MIN_BLOCK_SIZE) {
+        gap += align;
+    }
+    if (gap != 0) {
+        size_t total = blockSize(block);
+        size_t released = statusOf(block) & 4;
+        blockHeader *lead = block;
+        setStatus(lead, gap + (statusOf(lead) & 6));
+        writeFooter(lead);
+        insertFree(heap, lead);
+        block = (blockHeader *)((char *)lead + gap);
+        setStatus(block, total - gap + released); // p-bit clear, the lead block is free
+    }
+    placeBlock(heap, block, size);
+    return block;
+}
+
+/*
+ * Like allocBlock(), but aligned as for placeAligned().
+ * Caller must hold the heap's lock.
+ */
+static blockHeader *allocAlignedBlock(myHeap_t *heap, size_t size, size_t align, size_t skew) {
+    blockHeader *block = findFit(heap, alignedFitSize(size, align));
+
+    if (block == NULL) {
+        return NULL;
+    }
+    removeFree(heap, block);
+    return placeAligned(heap, block, size, align, skew);
+}
+
+/*
+ * Cuts up to 'max' allocated blocks of 'size' bytes out of an unlisted
+ * free block, front to back, and stores their payloads in 'out'.  Only
+ * the last block goes through placeBlock(), which deals with the
+ * remainder.  Returns the number of blocks cut, at least 1.
+ * Caller must hold the heap's lock.
+ */
+static size_t carveBlocks(myHeap_t *heap, blockHeader *block, size_t size, size_t max, void **out) {
+    size_t total = blockSize(block);
+    size_t released = statusOf(block) & 4;
+    size_t n = total / size;
+    size_t i;
+
+    if (n > max) {
+        n = max;
+    }
+    for (i = 0; i + 1 < n; i++) {
+        // Every block after the first follows an allocated one
+        setStatus(block, size + (i == 0 ? (statusOf(block) & 2) : 2) + 1 + newCanary(heap, block));
+        out[i] = (char *)block + sizeof(blockHeader);
+        block = (blockHeader *)((char *)block + size);
+    }
+    heap->stats.usedBytes += i * size;
+    setStatus(block, total - i * size + (i == 0 ? (statusOf(block) & 2) : 2) + released);
+    placeBlock(heap, block, size);
+    out[i] = (char *)block + sizeof(blockHeader);
+    return n;
+}
+
+/*
+ * Marks an allocated block free, updates the next block's p-bit and
+ * lists the block, merging it first in MYHEAP_COALESCE_IMMEDIATE mode.
+ * In MYHEAP_COALESCE_PENDING mode the block is queued instead, and the
+ * queue is drained once it is full.
+ * Caller must hold the heap's lock.
+ */
+static void releaseBlock(myHeap_t *heap, blockHeader *currentBlock) {
+    heap->stats.usedBytes -= blockSize(currentBlock);
+#ifdef MYHEAP_HARDENED
+    __atomic_fetch_sub(&currentBlock->size_status, (statusOf(currentBlock) & HEADER_CANARY) + 1,
+                       __ATOMIC_RELAXED);
+#else
+    __atomic_fetch_sub(&currentBlock->size_status, 1, __ATOMIC_RELAXED);
+#endif
+    writeFooter(currentBlock);
+    setPrevAllocated(nextBlockOf(currentBlock), 0);
+    if (heap->coalesceMode == MYHEAP_COALESCE_IMMEDIATE) {
+        currentBlock = mergeNeighbours(heap, currentBlock);
+        writeFooter(currentBlock);
+    }
+    insertFree(heap, currentBlock);
+    if (heap->coalesceMode == MYHEAP_COALESCE_PENDING) {
+        heap->pending[heap->pendingCount++] = currentBlock;
+        if (heap->pendingCount == PENDING_FREES) {
+            drainPending(heap);
+        }
+    }
+}
+
+/*
+ * Giving free pages back (MYHEAP_OPT_RELEASE_THRESHOLD).
+ *
+ * coalesce() hands the whole pages inside each free block of at least
+ * releaseThreshold bytes back to the system with MADV_DONTNEED and sets
+ * Bit2 in its header.  The header, links and footer are left alone, and
+ * the pages read as zero when they are next touched, which myCalloc
+ * relies on.  MADV_FREE would be cheaper, but may leave the old contents
+ * in place.  Splitting a released block leaves the mark on the pieces,
+ * since each piece's inner pages lie inside the old ones; merging clears
+ * it.
+ */
+/*
+ * Finds the pages of 'pagesize' bytes inside a free block that may be
+ * given back: those after its links and before its footer.  'lo' is not
+ * below 'hi' when there are none.
+ */
+static void interiorOf(blockHeader *block, uintptr_t pagesize, char **lo, char **hi) {
+    uintptr_t start = (uintptr_t)block + sizeof(blockHeader) + sizeof(freeLinks);
+    uintptr_t end = (uintptr_t)block + blockSize(block) - sizeof(blockHeader);
+
+    *lo = (char *)((start + pagesize - 1) & ~(pagesize - 1));
+    *hi = (char *)(end & ~(pagesize - 1));
+}
+
+/*
+ * Gives back the inner pages of every large free block that still has
+ * them.  Caller must hold the heap's lock.
+ */
+static void releaseFreePages(myHeap_t *heap) {
+    heapRegion *region;
+    blockHeader *current;
+
+    for (region = heap->regions; region != NULL; region = region->next) {
+        for (current = region->first; statusOf(current) != 1;
+             current = nextBlockOf(current)) {
+            char *lo;
+            char *hi;
+            if (!isFreeBlock(current) || (statusOf(current) & 4) != 0 ||
+                blockSize(current) < heap->releaseThreshold) {
+                continue;
+            }
+            interiorOf(current, region->pageSize, &lo, &hi);
+            if (lo < hi && madvise(lo, hi - lo, MADV_DONTNEED) == 0) {
+                setStatus(current, statusOf(current) + 4);
+                heap->stats.releasedBytes += hi - lo;
+            }
+        }
+    }
+}
+
+/*
+ * Slabs for small objects (MYHEAP_OPT_SLAB).
+ *
+ * A slab is an ordinary allocated heap block of exactly SLAB_SIZE bytes
+ * whose header sits on a multiple of SLAB_SIZE, so slabs carved one after
+ * the other tile with no gap between them.  The payload starts with a
+ * slab header and the rest is cut into equal slots of one of SLAB_CLASSES
+ * sizes (8 to SLAB_MAX_SIZE bytes in steps of 8), from SLAB_SLOTS bytes
+ * into the block.  Slots have no header of their own: a bitmap in the
+ * slab header records which ones are in use, and the slab of a slot is
+ * found by rounding its address down to SLAB_SIZE, see slabOf().
+ *
+ * Each region's slabMap has one bit per SLAB_SIZE unit of its mapping,
+ * set while the unit holds a slab, so myFree can tell a slot from a block
+ * payload without reading anything in front of the pointer.
+ *
+ * Slabs with free slots are kept on a per-class list.  A slab whose last
+ * slot is freed goes back to the heap, unless it is the only slab with
+ * free slots left in its class.
+ */
+#define SLAB_BITMAP_WORDS (SLAB_SIZE / 8 / 64)
+
+typedef struct slab {
+    struct slab *next;
+    struct slab *prev;
+    int slotSize;
+    int capacity;
+    int used;
+    int class;
+    unsigned long bitmap[SLAB_BITMAP_WORDS]; // bit set => slot in use
+    unsigned long queued[SLAB_BITMAP_WORDS]; // bit set => slot queued, see markRemote()
+} slab;
+
+// Offset of the first slot into a slab's block; a multiple of 16, so
+// slots whose size is one are 16-aligned as well
+#define SLAB_SLOTS ((sizeof(blockHeader) + sizeof(slab) + 15) / 16 * 16)
+
+/*
+ * Returns the slab header of the slab 'ptr' lies in.
+ */
+static slab *slabOf(void *ptr) {
+    return (slab *)(((uintptr_t)ptr & ~(uintptr_t)(SLAB_SIZE - 1)) + sizeof(blockHeader));
+}
+
+/*
+ * Returns the first slot of slab 's'.
+ */
+static char *slotsOf(slab *s) {
+    return (char *)s - sizeof(blockHeader) + SLAB_SLOTS;
+}
+
+/*
+ * Returns 1 if 'ptr', which lies in 'region', lies in a slab run, 0
+ * otherwise.
+ */
+static int inSlabRun(heapRegion *region, void *ptr) {
+    // Read without the lock by isLive(), so the map and its bits are atomic
+    unsigned char *map = __atomic_load_n(&region->slabMap, __ATOMIC_ACQUIRE);
+    unsigned long unit;
+
+    if (map == NULL) {
+        return 0;
+    }
+    unit = ((char *)ptr - region->base) / SLAB_SIZE;
+    return (__atomic_load_n(&map[unit / 8], __ATOMIC_ACQUIRE) >> (unit % 8)) & 1;
+}
+
+/*
+ * Returns 1 if 'ptr' lies in a slab run, 0 otherwise.
+ */
+static int isSlabPtr(myHeap_t *heap, void *ptr) {
+    heapRegion *region = findRegion(heap, ptr);
+
+    return region != NULL && inSlabRun(region, ptr);
+}
+
+/*
+ * Returns the number of bytes in the slabMap of 'region'.
+ */
+static size_t slabMapSize(heapRegion *region) {
+    return region->mapSize / SLAB_SIZE / 8 + 1;
+}
+
+static void setSlabUnit(myHeap_t *heap, slab *s, int inUse) {
+    heapRegion *region = findRegion(heap, s);
+    unsigned long unit = ((char *)s - region->base) / SLAB_SIZE;
+    if (inUse) {
+        // Publishes the slab, set up by now, to inSlabRun()
+        __atomic_fetch_or(&region->slabMap[unit / 8], 1 << (unit % 8), __ATOMIC_RELEASE);
+    } else {
+        __atomic_fetch_and(&region->slabMap[unit / 8], ~(1 << (unit % 8)), __ATOMIC_RELEASE);
+    }
+}
+
+static void pushPartial(myHeap_t *heap, slab *s) {
+    s->prev = NULL;
+    s->next = heap->partialSlabs[s->class];
+    if (s->next != NULL) {
+        s->next->prev = s;
+    }
+    heap->partialSlabs[s->class] = s;
+}
+
+static void unlinkPartial(myHeap_t *heap, slab *s) {
+    if (s->prev != NULL) {
+        s->prev->next = s->next;
+    } else {
+        heap->partialSlabs[s->class] = s->next;
+    }
+    if (s->next != NULL) {
+        s->next->prev = s->prev;
+    }
+}
+
+/*
+ * Carves a new slab for 'class' out of the heap and lists it.
+ * Returns NULL if the heap has no room for it.
+ */
+static slab *newSlab(myHeap_t *heap, int class) {
+    heapRegion *region;
+    blockHeader *block;
+    slab *s;
+    int i;
+
+    block = allocAlignedBlock(heap, SLAB_SIZE, SLAB_SIZE, 0);
+    if (block == NULL) {
+        return NULL;
+    }
+    region = findRegion(heap, block + 1);
+    if (region->slabMap == NULL) {
+        void *map = mmap(NULL, slabMapSize(region), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (MAP_FAILED == map) {
+            releaseBlock(heap, block);
+            return NULL;
+        }
+        __atomic_store_n(&region->slabMap, (unsigned char *)map, __ATOMIC_RELEASE);
+    }
+    s = (slab *)((char *)block + sizeof(blockHeader));
+    s->class = class;
+    s->slotSize = (class + 1) * 8;
+    s->capacity = (SLAB_SIZE - SLAB_SLOTS) / s->slotSize;
+    s->used = 0;
+    memset(s->queued, 0, sizeof(s->queued));
+    // Bits past the last slot are kept set so they are never handed out
+    for (i = 0; i < SLAB_BITMAP_WORDS; i++) {
+        int first = i * 64;
+        if (first + 64 <= s->capacity) {
+            s->bitmap[i] = 0;
+        } else if (first >= s->capacity) {
+            s->bitmap[i] = ~0UL;
+        } else {
+            s->bitmap[i] = ~0UL << (s->capacity - first);
+        }
+    }
+    setSlabUnit(heap, s, 1);
+    pushPartial(heap, s);
+    return s;
+}
+
+/*
+ * Returns a free slot of 'class', creating a slab if the class has none.
+ * Caller must hold the heap's lock.
+ */
+static void *slabAlloc(myHeap_t *heap, int class) {
+    slab *s = heap->partialSlabs[class];
+    int i;
+
+    if (s == NULL && (s = newSlab(heap, class)) == NULL) {
+        return NULL;
+    }
+    for (i = 0; s->bitmap[i] == ~0UL; i++) {
+    }
+    int slot = i * 64 + __builtin_ctzl(~s->bitmap[i]);
+    // isLive() reads the bitmap without the lock
+    __atomic_store_n(&s->bitmap[i], s->bitmap[i] | 1UL << (slot % 64), __ATOMIC_RELAXED);
+    if (++s->used == s->capacity) {
+        unlinkPartial(heap, s);
+    }
+    return slotsOf(s) + slot * s->slotSize;
+}
+
+/*
+ * Frees the slot at 'ptr'.  Returns 0 on success, -1 if 'ptr' is not the
+ * start of a slot in use.  Caller must hold the heap's lock.
+ */
+static int slabFree(myHeap_t *heap, void *ptr) {
+    slab *s = slabOf(ptr);
+    long offset = (char *)ptr - slotsOf(s);
+    int slot;
+
+    if (offset < 0 || offset % s->slotSize != 0 || offset / s->slotSize >= s->capacity) {
+        return -1;
+    }
+    slot = offset / s->slotSize;
+    if ((s->bitmap[slot / 64] & (1UL << (slot % 64))) == 0) {
+        return -1;
+    }
+    __atomic_store_n(&s->bitmap[slot / 64], s->bitmap[slot / 64] & ~(1UL << (slot % 64)),
+                     __ATOMIC_RELAXED);
+    if (s->used-- == s->capacity) {
+        pushPartial(heap, s);
+    }
+    if (s->used == 0 && (s->prev != NULL || s->next != NULL)) {
+        unlinkPartial(heap, s);
+        setSlabUnit(heap, s, 0);
+        releaseBlock(heap, (blockHeader *)((char *)s - sizeof(blockHeader)));
+    }
+    return 0;
+}
+
+/*
+ * Returns the number of bytes the caller may use at 'ptr', which must be
+ * a slot or the payload of an allocated block.
+ */
+static size_t usableSize(myHeap_t *heap, void *ptr) {
+    if (isSlabPtr(heap, ptr)) {
+        return slabOf(ptr)->slotSize;
+    }
+    return blockSize((blockHeader *)((char *)ptr - sizeof(blockHeader))) - sizeof(blockHeader);
+}
+
+/*
+ * Returns 1 if 'ptr', which lies in 'region', can be a slot or the payload
+ * of an allocated block, 0 if it cannot.
+ *
+ * Checks a constant number of words and takes no lock.  A slot must be at
+ * a slot boundary of its slab and marked in use.  A block must have the
+ * a-bit set, not be queued by pushRemote() and have a size that keeps it
+ * inside the region, and the header after it must have the p-bit set.
+ * So a stale pointer or one into the middle of a block is caught unless
+ * the words there happen to look like such a block, which in
+ * MYHEAP_HARDENED builds includes a matching canary.
+ */
+static int isLive(heapRegion *region, void *ptr) {
+    blockHeader *block = (blockHeader *)((char *)ptr - sizeof(blockHeader));
+    blockHeader *next;
+    size_t status;
+    size_t size;
+
+    if (inSlabRun(region, ptr)) {
+        slab *s = slabOf(ptr);
+        long offset = (char *)ptr - slotsOf(s);
+        int slot;
+
+        if (offset < 0 || offset % s->slotSize != 0 || offset / s->slotSize >= s->capacity) {
+            return 0;
+        }
+        slot = offset / s->slotSize;
+        return ((__atomic_load_n(&s->bitmap[slot / 64], __ATOMIC_RELAXED) &
+                 ~__atomic_load_n(&s->queued[slot / 64], __ATOMIC_RELAXED)) >> (slot % 64)) & 1;
+    }
+    status = statusOf(block); // read once, a thread holding the lock may change it
+    if ((status & 5) != 1) { // free, or queued to be
+        return 0;
+    }
+#ifdef MYHEAP_HARDENED
+    if ((status & HEADER_CANARY) != canaryOf(region, block)) {
+        return 0;
+    }
+#endif
+    size = status & ~STATUS_BITS;
+    if (size < MIN_BLOCK_SIZE || size > (size_t)((char *)region->endMark - (char *)block)) {
+        return 0;
+    }
+    next = (blockHeader *)((char *)block + size);
+    return next == region->endMark || (statusOf(next) & 2) != 0;
+}
+
+/*
+ * Frees a slot or an allocated block.  Caller must hold the heap's lock.
+ */
+static void releasePtr(myHeap_t *heap, void *ptr) {
+    if (isSlabPtr(heap, ptr)) {
+        slabFree(heap, ptr);
+    } else {
+        releaseBlock(heap, (blockHeader *)((char *)ptr - sizeof(blockHeader)));
+    }
+}
+
+/*
+ * Remote frees.
+ *
+ * myHeapFree does not wait for a heap whose lock another thread holds.
+ * It pushes the payload onto the heap's remoteFrees stack instead, linked
+ * through its first word, with one compare-and-swap and no lock.  Many
+ * threads may push at once.  Whoever takes the lock next to allocate
+ * swaps the whole stack out and frees the batch, so no entry is ever
+ * popped alone and the stack needs no ABA protection.  Until then the
+ * memory stays in use.
+ *
+ * Heaps are shared by all threads, so there is no owning thread to send
+ * a block back to: a free is remote when it finds the lock taken, by
+ * whichever thread.  A queued block is marked first, with bit2 of its
+ * header or a bit in its slab's queued map, so freeing it a second time
+ * fails instead of pushing it twice.
+ */
+
+/*
+ * Marks 'ptr', a slot or allocated block of 'region', as queued.
+ * Returns 0 if it was marked, -1 if it is queued or free already.
+ */
+static int markRemote(heapRegion *region, void *ptr) {
+    blockHeader *block = (blockHeader *)((char *)ptr - sizeof(blockHeader));
+    size_t status;
+
+    if (inSlabRun(region, ptr)) {
+        slab *s = slabOf(ptr);
+        int slot = ((char *)ptr - slotsOf(s)) / s->slotSize;
+        unsigned long bit = 1UL << (slot % 64);
+        if ((__atomic_load_n(&s->bitmap[slot / 64], __ATOMIC_RELAXED) & bit) == 0 ||
+            (__atomic_fetch_or(&s->queued[slot / 64], bit, __ATOMIC_RELAXED) & bit) != 0) {
+            return -1;
+        }
+        // A locked free may have taken the slot before the mark went on
+        if ((__atomic_load_n(&s->bitmap[slot / 64], __ATOMIC_RELAXED) & bit) == 0) {
+            __atomic_fetch_and(&s->queued[slot / 64], ~bit, __ATOMIC_RELAXED);
+            return -1;
+        }
+        return 0;
+    }
+    status = __atomic_load_n(&block->size_status, __ATOMIC_RELAXED);
+    do {
+        if ((status & 5) != 1) {
+            return -1;
+        }
+    } while (!__atomic_compare_exchange_n(&block->size_status, &status, status | 4, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 0;
+}
+
+/*
+ * Clears the mark markRemote() set on 'ptr'.  Caller must hold the
+ * heap's lock.
+ */
+static void unmarkRemote(myHeap_t *heap, void *ptr) {
+    if (isSlabPtr(heap, ptr)) {
+        slab *s = slabOf(ptr);
+        int slot = ((char *)ptr - slotsOf(s)) / s->slotSize;
+        __atomic_fetch_and(&s->queued[slot / 64], ~(1UL << (slot % 64)), __ATOMIC_RELAXED);
+    } else {
+        blockHeader *block = (blockHeader *)((char *)ptr - sizeof(blockHeader));
+        __atomic_fetch_and(&block->size_status, ~(size_t)4, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Pushes 'ptr', marked by markRemote(), onto the heap's remote stack.
+ */
+static void pushRemote(myHeap_t *heap, void *ptr) {
+    void *head = __atomic_load_n(&heap->remoteFrees, __ATOMIC_RELAXED);
+
+    do {
+        *(void **)ptr = head;
+    } while (!__atomic_compare_exchange_n(&heap->remoteFrees, &head, ptr, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * Frees everything pushed by pushRemote.  Caller must hold the heap's lock.
+ */
+static void drainRemote(myHeap_t *heap) {
+    void *ptr;
+
+    if (__atomic_load_n(&heap->remoteFrees, __ATOMIC_RELAXED) == NULL) {
+        return;
+    }
+    ptr = __atomic_exchange_n(&heap->remoteFrees, NULL, __ATOMIC_ACQUIRE);
+    while (ptr != NULL) {
+        void *next = *(void **)ptr;
+        unmarkRemote(heap, ptr);
+        releasePtr(heap, ptr);
+        heap->stats.frees++;
+        ptr = next;
+    }
+}
+
+/*
+ * Per-thread caches (MYHEAP_OPT_THREAD_CACHE), for defaultHeap only.
+ *
+ * Each thread keeps a small stack of allocated blocks and slots for every
+ * usable size from 8 to TCACHE_MAX_SIZE bytes in steps of 8, linked
+ * through the first word of their payload.  Cached memory stays marked
+ * in use in the heap and the slabs, so the rest of the allocator never
+ * sees it.  A hit in myAlloc or myFree touches only the calling thread's
+ * cache; a miss refills, and a full cache flushes, TCACHE_BATCH entries
+ * under a single lock acquisition.  A thread's cache is flushed back
+ * when the thread exits or after the option is turned off.
+ *
+ * With the scavenger running (MYHEAP_OPT_SCAVENGE), a miss first takes a
+ * whole batch the scavenger carved in advance from the depot, so the
+ * refill costs no search under the lock.  The depot keeps up to
+ * DEPOT_BATCHES batches for each class that missed since its last round.
+ */
+#define TCACHE_MAX_SIZE  256
+#define TCACHE_CLASSES   (TCACHE_MAX_SIZE / 8)
+#define TCACHE_MAX_COUNT 32
+#define TCACHE_BATCH     16
+#define DEPOT_BATCHES    4
+
+typedef struct threadCache {
+    void *blocks[TCACHE_CLASSES];
+    int count[TCACHE_CLASSES];
+    int total;
+    unsigned long allocs;    // hits not yet added to the heap's counters
+    unsigned long frees;
+} threadCache;
+
+static int threadCacheOn = 0;
+static __thread threadCache tcache;
+static pthread_key_t tcacheKey;
+static pthread_once_t tcacheKeyOnce = PTHREAD_ONCE_INIT;
+
+// Batches of TCACHE_BATCH entries linked like a cache; under defaultHeap.lock
+static void *depot[TCACHE_CLASSES][DEPOT_BATCHES];
+static int depotCount[TCACHE_CLASSES];
+static unsigned int depotMisses[TCACHE_CLASSES]; // refills the depot could not serve; atomic
+
+/*
+ * Adds the cache's hits to the heap's counters.  Caller must hold the
+ * heap's lock.
+ */
+static void tcacheCount(threadCache *cache) {
+    myHeap_t *heap = &defaultHeap;
+
+    heap->stats.allocs += cache->allocs;
+    heap->stats.frees += cache->frees;
+    cache->allocs = 0;
+    cache->frees = 0;
+}
+
+/*
+ * Returns every entry in the calling thread's cache to the heap.
+ */
+static void tcacheFlushAll(threadCache *cache) {
+    myHeap_t *heap = &defaultHeap;
+    int class;
+
+    if (cache->total == 0 && cache->allocs == 0 && cache->frees == 0) {
+        return;
+    }
+    pthread_mutex_lock(&heap->lock);
+    for (class = 0; class < TCACHE_CLASSES; class++) {
+        while (cache->blocks[class] != NULL) {
+            void *ptr = cache->blocks[class];
+            cache->blocks[class] = *(void **)ptr;
+            releasePtr(heap, ptr);
+        }
+        cache->count[class] = 0;
+    }
+    cache->total = 0;
+    tcacheCount(cache);
+    pthread_mutex_unlock(&heap->lock);
+}
+
+/*
+ * Thread exit hook registered through tcacheKey.
+ */
+static void tcacheDestructor(void *arg) {
+    (void)arg;
+    tcacheFlushAll(&tcache);
+}
+
+static void tcacheMakeKey() {
+    pthread_key_create(&tcacheKey, tcacheDestructor);
+}
+
+/*
+ * Makes sure the calling thread's cache is flushed when it exits.  Called
+ * whenever an empty cache is about to take entries, by allocation or by
+ * freeing, as a thread may only ever free.
+ */
+static void tcacheRegister() {
+    pthread_once(&tcacheKeyOnce, tcacheMakeKey);
+    pthread_setspecific(tcacheKey, &tcache);
+}
+
+/*
+ * Carves up to TCACHE_BATCH entries of 'class' from the slabs or the
+ * heap and links them onto '*list'.  Returns the number carved.
+ * Caller must hold the heap's lock.
+ */
+static int carveBatch(myHeap_t *heap, int class, void **list) {
+    int usable = (class + 1) * 8;
+    int i;
+
+    for (i = 0; i < TCACHE_BATCH; i++) {
+        void *ptr;
+        if (heap->slabOn && usable <= SLAB_MAX_SIZE) {
+            ptr = slabAlloc(heap, class);
+        } else {
+            blockHeader *block = allocBlock(heap, (sizeof(blockHeader) + usable + 7) / 8 * 8);
+            ptr = block != NULL ? (char *)block + sizeof(blockHeader) : NULL;
+        }
+        if (ptr == NULL) {
+            break;
+        }
+        *(void **)ptr = *list;
+        *list = ptr;
+    }
+    return i;
+}
+
+/*
+ * Gives every batch in the depot back to the heap.  Caller must hold the
+ * heap's lock.
+ */
+static void depotFlush(myHeap_t *heap) {
+    int class;
+
+    for (class = 0; class < TCACHE_CLASSES; class++) {
+        while (depotCount[class] > 0) {
+            void *ptr = depot[class][--depotCount[class]];
+            while (ptr != NULL) {
+                void *next = *(void **)ptr;
+                releasePtr(heap, ptr);
+                ptr = next;
+            }
+        }
+        __atomic_store_n(&depotMisses[class], 0, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Returns cached memory of size class 'class' ((class + 1) * 8 bytes),
+ * refilling the cache from the depot, the slabs or the heap when it is
+ * empty.  Returns NULL if the heap cannot provide any.
+ */
+static void *tcacheAlloc(int class) {
+    myHeap_t *heap = &defaultHeap;
+    void *ptr;
+
+    if (tcache.blocks[class] == NULL) {
+        int i;
+        tcacheRegister();
+        pthread_mutex_lock(&heap->lock);
+        drainRemote(heap);
+        if (depotCount[class] > 0) {
+            tcache.blocks[class] = depot[class][--depotCount[class]];
+            i = TCACHE_BATCH;
+        } else {
+            __atomic_fetch_add(&depotMisses[class], 1, __ATOMIC_RELAXED);
+            i = carveBatch(heap, class, &tcache.blocks[class]);
+        }
+        tcacheCount(&tcache);
+        pthread_mutex_unlock(&heap->lock);
+        tcache.count[class] += i;
+        tcache.total += i;
+        if (i == 0) {
+            return NULL;
+        }
+    }
+    ptr = tcache.blocks[class];
+    tcache.blocks[class] = *(void **)ptr;
+    tcache.count[class]--;
+    tcache.total--;
+    tcache.allocs++;
+    return ptr;
+}
+
+/*
+ * Caches a slot or allocated block of at least 'usable' bytes, 0 to look
+ * the size up, flushing TCACHE_BATCH entries of the same class first if
+ * that class is full.
+ * Returns 0 if 'ptr' was cached, -1 if its size is not cached, 1 if it is
+ * already in the cache (MYHEAP_HARDENED builds only).
+ *
+ * Built with MYHEAP_HARDENED the size is always looked up, so each block
+ * has one class, and the class is searched for 'ptr' first.  That is at
+ * most TCACHE_MAX_COUNT entries, and catches freeing twice before the
+ * block is reused by this thread.
+ */
+static int tcacheFree(void *ptr, size_t usable) {
+    myHeap_t *heap = &defaultHeap;
+    int class;
+
+#ifdef MYHEAP_HARDENED
+    usable = 0;
+#endif
+    if (usable == 0) {
+        usable = usableSize(heap, ptr);
+    } else {
+        usable = usable < 8 ? 8 : usable / 8 * 8; // a class it fully covers
+    }
+    if (usable < 8 || usable > TCACHE_MAX_SIZE) {
+        return -1;
+    }
+    class = usable / 8 - 1;
+#ifdef MYHEAP_HARDENED
+    {
+        void *cached;
+        for (cached = tcache.blocks[class]; cached != NULL; cached = *(void **)cached) {
+            if (cached == ptr) {
+                return 1;
+            }
+        }
+    }
+#endif
+    if (tcache.count[class] >= TCACHE_MAX_COUNT) {
+        int i;
+        pthread_mutex_lock(&heap->lock);
+        for (i = 0; i < TCACHE_BATCH; i++) {
+            void *old = tcache.blocks[class];
+            tcache.blocks[class] = *(void **)old;
+            releasePtr(heap, old);
+        }
+        tcacheCount(&tcache);
+        pthread_mutex_unlock(&heap->lock);
+        tcache.count[class] -= TCACHE_BATCH;
+        tcache.total -= TCACHE_BATCH;
+    }
+    if (tcache.total == 0) {
+        tcacheRegister();
+    }
+    *(void **)ptr = tcache.blocks[class];
+    tcache.blocks[class] = ptr;
+    tcache.count[class]++;
+    tcache.total++;
+    tcache.frees++;
+    return 0;
+}
+
+/*
+ * Direct mappings for huge requests (MYHEAP_OPT_MMAP_THRESHOLD).
+ *
+ * A request of at least mmapThreshold bytes gets a private anonymous
+ * mapping of its own, so it never splits or fragments a heap region and
+ * its pages go back to the system as soon as it is freed.  The mapping
+ * starts with a hugeHeader whose last field is an ordinary allocated block
+ * header, so the payload looks like that of any other block.  Huge blocks
+ * are kept on a list so myFree can recognise them.  For an aligned
+ * request the hugeHeader is moved 'lead' bytes into the mapping so that
+ * the payload right after it is aligned.
+ */
+typedef struct hugeHeader {
+    struct hugeHeader *next;
+    struct hugeHeader *prev;
+    size_t mapSize;          // counted from the start of the mapping
+    size_t lead;             // bytes in front of the hugeHeader
+    myHeap_t *heap;          // heap it was allocated from
+    blockHeader header;
+} hugeHeader;
+
+/*
+ * Maps a huge block with room for 'size' bytes of payload aligned to
+ * 'align' (a power of two, at least 8).  Alignments above the page size
+ * are met by mapping extra space and unmapping what is not needed.
+ * Returns the payload, or NULL if the mapping fails.
+ */
+static void *hugeAlloc(myHeap_t *heap, size_t size, size_t align) {
+    size_t pagesize = getpagesize();
+    size_t lead = 0;
+    size_t mapSize;
+    size_t extra = 0;
+    char *base;
+    hugeHeader *huge;
+
+    if (align > pagesize) {
+        extra = align - pagesize;
+        lead = align - sizeof(hugeHeader);
+    } else if (align > 8) {
+        lead = -sizeof(hugeHeader) & (align - 1);
+    }
+    if (size > SIZE_MAX / 2 - lead - extra - sizeof(hugeHeader) - pagesize) {
+        return NULL;
+    }
+    mapSize = (lead + sizeof(hugeHeader) + size + pagesize - 1) / pagesize * pagesize;
+    base = mmap(NULL, mapSize + extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == base) {
+        countFailure(heap);
+        return NULL;
+    }
+    if (extra != 0) { // keep the aligned part of the oversized mapping
+        size_t front = -(uintptr_t)base & (align - 1);
+        if (front != 0) {
+            munmap(base, front);
+        }
+        if (extra - front != 0) {
+            munmap(base + front + mapSize, extra - front);
+        }
+        base += front;
+    }
+    if (heap->numaNode >= 0) {
+        bindNode(base, mapSize, heap->numaNode);
+    }
+    huge = (hugeHeader *)(base + lead);
+    huge->mapSize = mapSize;
+    huge->lead = lead;
+    huge->header.size_status = (mapSize - lead - offsetof(hugeHeader, header)) + 2 + 1;
+    huge->heap = heap;
+    if (setOwner((char *)(huge + 1), 1, (char *)huge + OWNER_HUGE) != 0) {
+        munmap(base, mapSize);
+        countFailure(heap);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&heap->lock);
+    huge->prev = NULL;
+    huge->next = heap->hugeBlocks;
+    if (heap->hugeBlocks != NULL) {
+        heap->hugeBlocks->prev = huge;
+    }
+    heap->hugeBlocks = huge;
+    heap->stats.hugeBytes += mapSize;
+    heap->stats.allocs++;
+    pthread_mutex_unlock(&heap->lock);
+    return huge + 1;
+}
+
+/*
+ * Returns the huge block of 'heap' whose payload starts at 'ptr', or NULL
+ * if there is none.  Only the ownership map is read, so no lock is needed
+ * to find it.
+ */
+static hugeHeader *findHuge(myHeap_t *heap, void *ptr) {
+    char *owner = ownerOf(ptr);
+    hugeHeader *huge = (hugeHeader *)(owner - OWNER_HUGE);
+
+    if (((uintptr_t)owner & OWNER_HUGE) == 0 || (void *)(huge + 1) != ptr || huge->heap != heap) {
+        return NULL;
+    }
+    return huge;
+}
+
+/*
+ * Unlists a huge block and unmaps it.  Caller must hold the heap's lock.
+ */
+static void hugeFree(myHeap_t *heap, hugeHeader *huge) {
+    if (huge->prev != NULL) {
+        huge->prev->next = huge->next;
+    } else {
+        heap->hugeBlocks = huge->next;
+    }
+    if (huge->next != NULL) {
+        huge->next->prev = huge->prev;
+    }
+    heap->stats.hugeBytes -= huge->mapSize;
+    heap->stats.frees++;
+    setOwner((char *)(huge + 1), 1, NULL);
+    munmap((char *)huge - huge->lead, huge->mapSize);
+}
+
+/*
+ * Resizes the mapping of a huge block to 'mapSize' bytes: in place if the
+ * kernel can, else by moving it over space mapped for it first, so that
+ * its new payload is in the ownership map before the block is there.
+ * Returns the block's header, moved or not, or NULL if it is unchanged.
+ * Caller must hold the heap's lock.
+ */
+static hugeHeader *remapHuge(hugeHeader *huge, size_t mapSize) {
+    size_t lead = huge->lead;
+    char *old = (char *)huge - lead;
+    char *space;
+    hugeHeader *moved;
+
+    if (MAP_FAILED != mremap(old, huge->mapSize, mapSize, 0)) {
+        return huge;
+    }
+    space = mmap(NULL, mapSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == space) {
+        return NULL;
+    }
+    moved = (hugeHeader *)(space + lead);
+    if (setOwner((char *)(moved + 1), 1, (char *)moved + OWNER_HUGE) != 0) {
+        munmap(space, mapSize);
+        return NULL;
+    }
+    // Cleared before the move: after it, a new mapping may get the old address
+    setOwner((char *)(huge + 1), 1, NULL);
+    if (MAP_FAILED == mremap(old, huge->mapSize, mapSize, MREMAP_MAYMOVE | MREMAP_FIXED, space)) {
+        setOwner((char *)(huge + 1), 1, (char *)huge + OWNER_HUGE); // its leaf exists
+        setOwner((char *)(moved + 1), 1, NULL);
+        munmap(space, mapSize);
+        return NULL;
+    }
+    return moved;
+}
+
+/*
+ * Sampling allocation profiler (MYHEAP_OPT_SAMPLE_INTERVAL).
+ *
+ * Each thread counts down the bytes it allocates from the default heap;
+ * when the count drops below zero the allocation is sampled and the
+ * count restarts at a random gap, exponentially distributed with mean
+ * sampleInterval bytes; a thread's first count starts at such a gap as
+ * well.  A
+ * sample records the call stack of the allocation.  Sampled blocks that
+ * are still live are kept in a hash table by address, and every distinct
+ * stack is a call site with running totals.  myHeapProfile() writes the
+ * sites as a pprof heap profile.
+ *
+ * Everything lives in one mapping made when sampling is first turned on,
+ * so the profiler never allocates from the heap it watches.  myFree only
+ * takes sampleLock when the pointer's hash bucket is not empty, which is
+ * rare unless many samples are live.
+ */
+#define SAMPLE_DEPTH   24     // frames kept per stack
+#define SAMPLE_SKIP    2      // sampleAlloc itself and the API function
+#define SAMPLE_BUCKETS 16384  // live sample hash buckets, a power of two
+#define SAMPLE_RECORDS 65536  // live samples at most
+#define SAMPLE_SITES   4096   // distinct call stacks at most, a power of two
+
+typedef struct sampleRecord {
+    struct sampleRecord *next;
+    void *ptr;
+    size_t size;
+    int site;
+} sampleRecord;
+
+typedef struct sampleSite {
+    unsigned long hash;
+    int depth;                 // 0 while the entry is unused
+    void *stack[SAMPLE_DEPTH];
+    unsigned long allocs;      // samples taken here
+    size_t allocBytes;
+    unsigned long live;        // of those, not freed yet
+    size_t liveBytes;
+} sampleSite;
+
+typedef struct sampleTable {
+    sampleRecord *buckets[SAMPLE_BUCKETS];
+    sampleRecord *freeRecords;
+    unsigned long usedRecords; // records handed out from 'records' so far
+    unsigned long dropped;     // samples lost because a table was full
+    sampleSite sites[SAMPLE_SITES];
+    sampleRecord records[SAMPLE_RECORDS];
+} sampleTable;
+
+static long sampleInterval = 0;
+static sampleTable *samples = NULL;
+static pthread_mutex_t sampleLock = PTHREAD_MUTEX_INITIALIZER;
+static __thread long sampleCountdown;
+static __thread unsigned long sampleSeed;
+static __thread int inSample;
+
+/*
+ * Maps the sample table and loads what backtrace() needs, so neither
+ * happens inside an allocation later on.  Returns 0 on success, -1 if
+ * the mapping fails.
+ */
+static int sampleSetup() {
+    void *frame;
+    sampleTable *table;
+
+    if (samples != NULL) {
+        return 0;
+    }
+    backtrace(&frame, 1);
+    table = mmap(NULL, sizeof(sampleTable), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == table) {
+        return -1;
+    }
+    pthread_mutex_lock(&sampleLock);
+    if (samples == NULL) {
+        __atomic_store_n(&samples, table, __ATOMIC_RELEASE);
+        table = NULL;
+    }
+    pthread_mutex_unlock(&sampleLock);
+    if (table != NULL) {
+        munmap(table, sizeof(sampleTable));
+    }
+    return 0;
+}
+
+static unsigned long hashPtr(void *ptr) {
+    return ((uintptr_t)ptr >> 3) * 0x9E3779B97F4A7C15UL;
+}
+
+/*
+ * Returns the natural logarithm of 'x' > 0, good to about 1e-10, so that
+ * the library needs no libm.
+ */
+static double logOf(double x) {
+    double ln2 = 0.69314718055994530942;
+    double t;
+    double t2;
+    double sum;
+    int exponent = 0;
+
+    while (x >= 1.41421356237309504880) {
+        x /= 2;
+        exponent++;
+    }
+    while (x < 0.70710678118654752440) {
+        x *= 2;
+        exponent--;
+    }
+    // ln x = 2 atanh((x - 1) / (x + 1)), and |t| < 0.18 here
+    t = (x - 1) / (x + 1);
+    t2 = t * t;
+    sum = 1 + t2 * (1.0 / 3 + t2 * (1.0 / 5 + t2 * (1.0 / 7 + t2 * (1.0 / 9 + t2 / 11))));
+    return exponent * ln2 + 2 * t * sum;
+}
+
+/*
+ * Returns the next gap in bytes, drawn from an exponential distribution
+ * with mean 'interval', which is what pprof assumes when it scales the
+ * samples of a heap_v2 profile back up.
+ */
+static long sampleGap(long interval) {
+    double u;
+
+    if (sampleSeed == 0) {
+        sampleSeed = (uintptr_t)&sampleSeed | 1;
+    }
+    sampleSeed ^= sampleSeed << 13;
+    sampleSeed ^= sampleSeed >> 7;
+    sampleSeed ^= sampleSeed << 17;
+    // Uniform in (0, 1], from the top 53 bits
+    u = (double)((sampleSeed >> 11) + 1) / 9007199254740992.0;
+    return 1 + (long)(-logOf(u) * (double)interval);
+}
+
+/*
+ * Returns the index of the site for a stack, adding it if it is new, or
+ * -1 if the site table is full.  Caller must hold sampleLock.
+ */
+static int findSite(void **stack, int depth) {
+    unsigned long hash = depth;
+    int probe;
+    int i;
+
+    for (i = 0; i < depth; i++) {
+        hash = (hash ^ (uintptr_t)stack[i]) * 0x100000001B3UL;
+    }
+    for (probe = 0; probe < SAMPLE_SITES; probe++) {
+        int index = (hash + probe) & (SAMPLE_SITES - 1);
+        sampleSite *site = &samples->sites[index];
+        if (site->depth == 0) {
+            site->hash = hash;
+            site->depth = depth;
+            memcpy(site->stack, stack, depth * sizeof(void *));
+            return index;
+        }
+        if (site->hash == hash && site->depth == depth &&
+            memcmp(site->stack, stack, depth * sizeof(void *)) == 0) {
+            return index;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Records a sampled allocation of 'size' bytes at 'ptr' and restarts the
+ * calling thread's countdown.
+ */
+static __attribute__((noinline)) void sampleAlloc(void *ptr, size_t size) {
+    void *stack[SAMPLE_DEPTH + SAMPLE_SKIP];
+    sampleRecord *record;
+    unsigned long bucket;
+    int depth;
+    int site;
+
+    if (inSample || sampleInterval == 0 || samples == NULL) {
+        return;
+    }
+    if (sampleSeed == 0) {
+        // The thread's first allocation: start its countdown at a random
+        // gap rather than at 0, which would sample every thread's first
+        sampleCountdown = sampleGap(sampleInterval) - (long)size;
+        if (sampleCountdown >= 0) {
+            return;
+        }
+    }
+    sampleCountdown = sampleGap(sampleInterval);
+    inSample = 1;
+    depth = backtrace(stack, SAMPLE_DEPTH + SAMPLE_SKIP) - SAMPLE_SKIP;
+    inSample = 0;
+    if (depth <= 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&sampleLock);
+    site = findSite(stack + SAMPLE_SKIP, depth);
+    record = samples->freeRecords;
+    if (record != NULL) {
+        samples->freeRecords = record->next;
+    } else if (samples->usedRecords < SAMPLE_RECORDS) {
+        record = &samples->records[samples->usedRecords++];
+    }
+    if (site < 0 || record == NULL) {
+        if (record != NULL) {
+            record->next = samples->freeRecords;
+            samples->freeRecords = record;
+        }
+        samples->dropped++;
+        pthread_mutex_unlock(&sampleLock);
+        return;
+    }
+    record->ptr = ptr;
+    record->size = size;
+    record->site = site;
+    bucket = hashPtr(ptr) >> (64 - __builtin_ctz(SAMPLE_BUCKETS));
+    record->next = samples->buckets[bucket];
+    __atomic_store_n(&samples->buckets[bucket], record, __ATOMIC_RELEASE);
+    samples->sites[site].allocs++;
+    samples->sites[site].allocBytes += size;
+    samples->sites[site].live++;
+    samples->sites[site].liveBytes += size;
+    pthread_mutex_unlock(&sampleLock);
+}
+
+/*
+ * Forgets 'ptr' if it is a live sampled block.  Called before the block
+ * is freed, so its address cannot have been handed out again yet.
+ */
+static void sampleFree(void *ptr) {
+    sampleTable *table = __atomic_load_n(&samples, __ATOMIC_ACQUIRE);
+    sampleRecord **link;
+    unsigned long bucket;
+
+    if (table == NULL || ptr == NULL) {
+        return;
+    }
+    bucket = hashPtr(ptr) >> (64 - __builtin_ctz(SAMPLE_BUCKETS));
+    if (__atomic_load_n(&table->buckets[bucket], __ATOMIC_ACQUIRE) == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&sampleLock);
+    for (link = &table->buckets[bucket]; *link != NULL; link = &(*link)->next) {
+        sampleRecord *record = *link;
+        if (record->ptr == ptr) {
+            __atomic_store_n(link, record->next, __ATOMIC_RELEASE); // heads are read unlocked
+            table->sites[record->site].live--;
+            table->sites[record->site].liveBytes -= record->size;
+            record->next = table->freeRecords;
+            table->freeRecords = record;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sampleLock);
+}
+
+/*
+ * Returns 'ptr', after sampling it if the calling thread's countdown
+ * runs out.  Kept inline so the sampled stack starts at the API function.
+ */
+static inline __attribute__((always_inline)) void *sampled(void *ptr, size_t size) {
+    if (sampleInterval != 0 && ptr != NULL && (sampleCountdown -= (long)size) < 0) {
+        sampleAlloc(ptr, size);
+    }
+    return ptr;
+}
+
+/*
+ * Maps and sets up a heap of 'size' bytes with its descriptor at the
+ * start of the first mapping, bound to NUMA node 'node' unless it is -1.
+ * Returns NULL on failure.
+ */
+static myHeap_t *createHeap(size_t size, int node) {
+    size_t pagesize = getpagesize();
+    size_t offset = (sizeof(myHeap_t) + 7) / 8 * 8; // keeps payloads 8-aligned
+    size_t mapSize;
+    myHeap_t *heap;
+
+    if (size == 0 || size > SIZE_MAX / 2) {
+        return NULL;
+    }
+    mapSize = (offset + size + sizeof(blockHeader) + pagesize - 1) / pagesize * pagesize;
+    heap = mapZeroed(mapSize);
+    if (heap == NULL) {
+        return NULL;
+    }
+    if (node >= 0) {
+        bindNode(heap, mapSize, node); // before the first page is touched
+    }
+    pthread_mutex_init(&heap->lock, NULL); // every other field starts out zero
+    heap->numaNode = node;
+    heap->canarySecret = newCanarySecret();
+    if (formatRegion(heap, &heap->firstRegion, (char *)heap, mapSize, offset, MYHEAP_PAGES_SMALL) != 0) {
+        pthread_mutex_destroy(&heap->lock);
+        munmap(heap, mapSize);
+        return NULL;
+    }
+    return heap;
+}
+
+/*
+ * NUMA-local heaps (MYHEAP_OPT_NUMA).
+ *
+ * With the option on, the functions for the default heap take memory
+ * from a heap of the calling thread's NUMA node instead.  A node's heap
+ * is made on first use with the size and options the default heap has
+ * then, and may always grow.  All of its mappings are bound to the node
+ * before they are touched.  A thread looks up its node again every
+ * NODE_RECHECK allocations, so one that moves to another socket follows
+ * after a while.
+ *
+ * Blocks are freed into the heap that owns them, wherever the freeing
+ * thread runs; ownerHeap() finds it in the ownership map.  Thread
+ * caches and coalesceStep() only cover the default heap; coalesce()
+ * covers every heap.
+ */
+#define NODE_RECHECK 1024
+
+// Node heaps first, then the heaps of myAllocHint, see hintSlot()
+#define SIDE_HEAPS (MAX_NODES + MYHEAP_HINT_LONG)
+
+static int numaOn = 0;
+static int numaNodes = 0;        // nodes the system may have, at most MAX_NODES
+static myHeap_t *sideHeaps[SIDE_HEAPS];
+static int sideHeapsMade = 0;    // set once any node or hint heap exists
+static pthread_mutex_t numaLock = PTHREAD_MUTEX_INITIALIZER; // also makes hint heaps
+static __thread int threadNode;
+static __thread unsigned int nodeTicks;
+
+/*
+ * Returns the number of possible NUMA nodes, from sysfs ("0", "0-3",
+ * "0,2-3" and so on), or 1 if it cannot be read.
+ */
+static int countNodes() {
+    char text[256];
+    int fd = open("/sys/devices/system/node/possible", O_RDONLY);
+    ssize_t got;
+    int highest = 0;
+    int i;
+
+    if (fd < 0) {
+        return 1;
+    }
+    got = read(fd, text, sizeof(text) - 1);
+    close(fd);
+    for (i = 0; i < got; i++) {
+        int value = 0;
+        if (text[i] < '0' || text[i] > '9') {
+            continue;
+        }
+        while (i < got && text[i] >= '0' && text[i] <= '9') {
+            value = value * 10 + text[i++] - '0';
+        }
+        if (value > highest) {
+            highest = value;
+        }
+    }
+    return highest + 1 < MAX_NODES ? highest + 1 : MAX_NODES;
+}
+
+/*
+ * Returns the NUMA node of the calling thread, looked up now and then.
+ */
+static int currentNode() {
+    if (nodeTicks == 0) {
+        unsigned int cpu;
+        unsigned int node;
+        nodeTicks = NODE_RECHECK;
+        threadNode = 0;
+        if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0 && node < (unsigned int)numaNodes) {
+            threadNode = node;
+        }
+    }
+    nodeTicks--;
+    return threadNode;
+}
+
+/*
+ * Makes the side heap in sideHeaps[slot], bound to 'node' unless it is
+ * -1, copying the default heap's options.  Returns the heap, or NULL if
+ * it cannot be mapped or myInit has not run.
+ */
+static myHeap_t *makeSideHeap(int slot, int node) {
+    myHeap_t *heap;
+
+    pthread_mutex_lock(&numaLock);
+    heap = sideHeaps[slot];
+    if (heap == NULL && defaultHeap.size != 0) {
+        heap = createHeap(defaultHeap.size, node);
+        if (heap != NULL) {
+            pthread_mutex_lock(&defaultHeap.lock);
+            heap->coalesceMode = defaultHeap.coalesceMode;
+            heap->slabOn = defaultHeap.slabOn;
+            heap->hugePagesOn = defaultHeap.hugePagesOn;
+            heap->releaseThreshold = defaultHeap.releaseThreshold;
+            heap->mmapThreshold = defaultHeap.mmapThreshold;
+            heap->placement = defaultHeap.placement;
+            heap->fitCandidates = defaultHeap.fitCandidates;
+            heap->minRemainder = defaultHeap.minRemainder;
+            heap->carveHigh = defaultHeap.carveHigh;
+            heap->index.mode = defaultHeap.index.mode;
+            pthread_mutex_unlock(&defaultHeap.lock);
+            heap->growOn = 1;
+            heap->hint = slot >= MAX_NODES ? slot - MAX_NODES + 1 : MYHEAP_HINT_NONE;
+            rebuildIndex(heap);
+            __atomic_store_n(&sideHeaps[slot], heap, __ATOMIC_RELEASE);
+            __atomic_store_n(&sideHeapsMade, 1, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&numaLock);
+    return heap;
+}
+
+/*
+ * Returns the heap the default heap's functions allocate from: the
+ * calling thread's node heap with MYHEAP_OPT_NUMA on, or the default heap.
+ */
+static myHeap_t *localHeap() {
+    myHeap_t *heap;
+    int node;
+
+    if (!numaOn) {
+        return &defaultHeap;
+    }
+    node = currentNode();
+    heap = __atomic_load_n(&sideHeaps[node], __ATOMIC_ACQUIRE);
+    if (heap == NULL) {
+        heap = makeSideHeap(node, node);
+    }
+    return heap != NULL ? heap : &defaultHeap;
+}
+
+/*
+ * Lifetime-hinted heaps (myAllocHint).
+ *
+ * Blocks hinted MYHEAP_HINT_SHORT and MYHEAP_HINT_LONG each come from a
+ * heap of their own, made on first use like a node heap but not bound to
+ * a node.  Request buffers that die together then sit next to each other
+ * and free as runs that merge, while long-lived entries neither split
+ * nor pin the free space between them.  Freeing, myRealloc and the other
+ * functions for the default heap find these heaps through ownerHeap().
+ */
+static int hintSlot(int hint) {
+    return MAX_NODES + hint - 1;
+}
+
+/*
+ * Returns the heap for 'hint' (MYHEAP_HINT_SHORT or MYHEAP_HINT_LONG),
+ * or NULL if it cannot be made.
+ */
+static myHeap_t *hintHeap(int hint) {
+    myHeap_t *heap = __atomic_load_n(&sideHeaps[hintSlot(hint)], __ATOMIC_ACQUIRE);
+
+    if (heap == NULL) {
+        heap = makeSideHeap(hintSlot(hint), -1);
+    }
+    return heap;
+}
+
+/*
+ * Returns the heap that owns 'ptr': the default heap, unless a node or
+ * hint heap has a region or a huge block at that address.  One lookup in
+ * the ownership map, see ownerOf().
+ */
+static myHeap_t *ownerHeap(void *ptr) {
+    char *owner = ownerOf(ptr);
+    myHeap_t *heap;
+
+    if (owner == NULL) {
+        return &defaultHeap;
+    }
+    if (((uintptr_t)owner & OWNER_HUGE) != 0) {
+        heap = ((hugeHeader *)(owner - OWNER_HUGE))->heap;
+    } else {
+        heap = ((heapRegion *)owner)->heap;
+    }
+    // Heaps of myHeapCreate and myHeapOpen are not the default heap's
+    return heap->numaNode >= 0 || heap->hint != MYHEAP_HINT_NONE ? heap : &defaultHeap;
+}
+
+/* 
+ * Function for allocating 'size' bytes of heap memory.
+ * Argument heap: heap to allocate from
+ * Argument size: requested size for the payload
+ * Returns address of allocated block (payload) on success.
+ * Returns NULL on failure.
+ *
+ * This function must:
+ * - Check size - Return NULL if not positive or if larger than heap space.
+ * - Determine block size rounding up to a multiple of 8 
+ *   and possibly adding padding as a result.
+ *
+ * - Use BEST-FIT PLACEMENT POLICY to chose a free block
+ *   (only the segregated free lists are searched, never allocated blocks;
+ *   with MYHEAP_INDEX_TLSF the block is the O(1) good fit whose distance
+ *   from the best fit is bounded as described above freeLinks)
+ *
+ * - If the BEST-FIT block that is found is exact size match
+ *   - 1. Update all heap blocks as needed for any affected blocks
+ *   - 2. Return the address of the allocated block payload
+ *
+ * - If the BEST-FIT block that is found is large enough to split 
+ *   - 1. SPLIT the free block into two valid heap blocks:
+ *         1. an allocated block
+ *         2. a free block
+ *         NOTE: both blocks must meet heap block requirements 
+ *       - Update all heap block header(s) and footer(s) 
+ *              as needed for any affected blocks.
+ *   - 2. Return the address of the allocated block payload
+ *
+ * - If a BEST-FIT block found is NOT found, return NULL
+ *   Return NULL unable to find and allocate block for desired size
+ *
+ * Note: payload address that is returned is NOT the address of the
+ *       block header.  It is the address of the start of the 
+ *       available memory for the requesterr.
+ *
+ * Small sizes are served from the calling thread's cache when
+ * MYHEAP_OPT_THREAD_CACHE is on (default heap only), and from a slab slot
+ * (with no block header) when MYHEAP_OPT_SLAB is on.  Sizes of at least
+ * the MYHEAP_OPT_MMAP_THRESHOLD get a mapping of their own.
+ * Safe to call from several threads.
+ *
+ * Tips: Be careful with pointer arithmetic and scale factors.
+ */
+void* myHeapAlloc(myHeap_t *heap, size_t size) {     
+    blockHeader *block;
+    size_t padded;
+
+    if (size == 0 || size > SIZE_MAX / 2) { //Checks if the size is zero or absurd
+        return NULL;
+    }
+
+    if (heap == &defaultHeap) {
+        if (threadCacheOn) {
+            if (size <= TCACHE_MAX_SIZE) {
+                void *ptr = tcacheAlloc((size + 7) / 8 - 1);
+                if (ptr != NULL) {
+                    return ptr;
+                }
+            }
+        } else if (tcache.total != 0) {
+            tcacheFlushAll(&tcache);
+        }
+    }
+
+    if (heap->slabOn && size <= SLAB_MAX_SIZE) {
+        pthread_mutex_lock(&heap->lock);
+        drainRemote(heap);
+        void *ptr = slabAlloc(heap, (size + 7) / 8 - 1);
+        if (ptr != NULL) {
+            heap->stats.allocs++;
+        }
+        pthread_mutex_unlock(&heap->lock);
+        if (ptr != NULL) {
+            return ptr;
+        }
+    }
+
+    if (heap->mmapThreshold != 0 && size >= heap->mmapThreshold) {
+        return hugeAlloc(heap, size, 8);
+    }
+
+    padded = sizeof(blockHeader) + size;
+    if (padded % 8 != 0) { //Checks if padding is required
+        padded = padded + 8 - (padded % 8);
+    }
+    if (__atomic_load_n(&heap->size, __ATOMIC_RELAXED) < padded && !heap->growOn) { //Checks if size is greater than heap
+        countFailure(heap);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&heap->lock);
+    drainRemote(heap);
+    block = allocBlock(heap, padded);
+    countResult(heap, block != NULL);
+    pthread_mutex_unlock(&heap->lock);
+    if (block == NULL) {
+        return NULL;
+    }
+    return ((char *)block + sizeof(blockHeader));
+} 
+
+/*
+ * Function for allocating 'size' bytes from the default heap.
+ * See myHeapAlloc().
+ */
+void* myAlloc(size_t size) {
+    return sampled(myHeapAlloc(localHeap(), size), size);
+}
+
+/*
+ * Function for allocating 'size' bytes for a block of a known lifetime.
+ * Argument size: requested size for the payload
+ * Argument hint: one of the MYHEAP_HINT_* constants in myHeap.h
+ * Returns address of allocated block (payload) on success.
+ * Returns NULL on failure or if hint is not valid.
+ *
+ * Blocks of each hint other than MYHEAP_HINT_NONE come from a heap of
+ * their own, apart from the default heap, so short- and long-lived
+ * blocks are never mixed.  They are freed with myFree as usual, and
+ * myRealloc keeps them in their heap.  Hinted blocks skip the thread
+ * cache and NUMA-local heaps.
+ */
+void* myAllocHint(size_t size, int hint) {
+    myHeap_t *heap;
+
+    if (hint == MYHEAP_HINT_NONE) {
+        return myAlloc(size);
+    }
+    if (hint != MYHEAP_HINT_SHORT && hint != MYHEAP_HINT_LONG) {
+        return NULL;
+    }
+    heap = hintHeap(hint);
+    if (heap == NULL) {
+        return NULL;
+    }
+    return sampled(myHeapAlloc(heap, size), size);
+}
+
+/*
+ * Function for allocating a small block by its size class.
+ * Argument sizeClass: MYHEAP_SIZE_CLASS(size) for a size of at most
+ * MYHEAP_SMALL_MAX bytes
+ * Returns address of a block of (sizeClass + 1) * 8 bytes on success.
+ * Returns NULL on failure or if sizeClass is out of range.
+ *
+ * Meant for sizes known when compiling, where the class is a constant:
+ * with thread caches on (MYHEAP_OPT_THREAD_CACHE) a hit goes straight to
+ * the cache's list for the class.  Without them it is the same as
+ * myAlloc((sizeClass + 1) * 8): a slab slot for up to 128 bytes with
+ * MYHEAP_OPT_SLAB on, else a search of the free-block index.
+ */
+void* myAllocClass(int sizeClass) {
+    size_t size;
+    myHeap_t *heap;
+
+    if (sizeClass < 0 || sizeClass >= TCACHE_CLASSES) {
+        return NULL;
+    }
+    size = (sizeClass + 1) * 8;
+    heap = localHeap();
+    if (heap == &defaultHeap && threadCacheOn) {
+        void *ptr = tcacheAlloc(sizeClass);
+        if (ptr != NULL) {
+            return sampled(ptr, size);
+        }
+    }
+    return sampled(myHeapAlloc(heap, size), size);
+}
+ 
+/*
+ * Frees a block for myHeapFree and myFreeSized; 'size' is 0 or the
+ * size the block was asked for.
+ */
+static int freeSized(myHeap_t *heap, void *ptr, size_t size) {
+if (ptr == NULL) {
+    return -1;
+}
+if (((uintptr_t)ptr) % 8 != 0) { //Checks padding
+    return -1;
+}
+heapRegion *region = findRegion(heap, ptr); //Checks if the pointer is inside one of the heap regions
+if (region == NULL) {
+    pthread_mutex_lock(&heap->lock);
+    hugeHeader *huge = findHuge(heap, ptr);
+    if (huge != NULL) {
+        hugeFree(heap, huge);
+    }
+    pthread_mutex_unlock(&heap->lock);
+    return huge != NULL ? 0 : -1;
+}
+if (!isLive(region, ptr)) { //Checks if the block is allocated, and a block at all
+    return -1;
+}
+#ifdef MYHEAP_HARDENED
+if (size > usableSize(heap, ptr)) { // a wrong size would break the heap
+    return -1;
+}
+#endif
+int slot = inSlabRun(region, ptr);
+if (heap == &defaultHeap) {
+    if (threadCacheOn) {
+        int cached = tcacheFree(ptr, size);
+        if (cached >= 0) {
+            return cached == 0 ? 0 : -1;
+        }
+    } else if (tcache.total != 0) {
+        tcacheFlushAll(&tcache);
+    }
+}
+int result = 0;
+if (pthread_mutex_trylock(&heap->lock) != 0) {
+    if (markRemote(region, ptr) != 0) { // freed twice
+        return -1;
+    }
+    pushRemote(heap, ptr); // freed by the next allocation, see drainRemote()
+    return 0;
+}
+drainRemote(heap);
+if (slot) {
+    result = slabFree(heap, ptr);
+} else {
+    releaseBlock(heap, (blockHeader *)((char *)ptr - sizeof(blockHeader)));
+}
+if (result == 0) {
+    heap->stats.frees++;
+}
+pthread_mutex_unlock(&heap->lock);
+
+return result;
+} 
+
+/* 
+ * Function for freeing up a previously allocated block.
+ * Argument heap: heap the block was allocated from
+ * Argument ptr: address of the block to be freed up.
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ * This function should:
+ * - Return -1 if ptr is NULL.
+ * - Return -1 if ptr is not a multiple of 8.
+ * - Return -1 if ptr is outside of the heap space, including when it
+ *   belongs to another heap.
+ * - Return -1 if ptr block is already freed.
+ * - Return -1 if ptr is not the start of a slot or block in use, as far
+ *   as the few words checked by isLive() tell.
+ * - Update header(s) and footer as needed.
+ *
+ * Memory freed into a thread cache stays in use in the heap, so freeing
+ * it a second time before it is reused is not detected, unless myHeap.c
+ * is built with MYHEAP_HARDENED and it is still in this thread's cache.
+ * A block freed while another thread holds the heap's lock is queued
+ * without waiting and freed by the heap's next allocation; freeing it
+ * again before then returns -1.
+ * Huge blocks are unmapped right away.
+ */                    
+int myHeapFree(myHeap_t *heap, void *ptr) {
+    return freeSized(heap, ptr, 0);
+}
+
+/*
+ * Function for freeing a block of the default heap.
+ * See myHeapFree().
+ */
+int myFree(void *ptr) {
+    sampleFree(ptr);
+    return myHeapFree(ownerHeap(ptr), ptr);
+}
+
+/*
+ * Function for freeing a block whose size is known, as for C++ sized
+ * deallocation.
+ * Argument ptr: address of the block to be freed up
+ * Argument size: the size it was allocated or last resized with, or 0
+ * Returns 0 on success, -1 on failure as for myFree.
+ *
+ * The size saves looking the block's size up when it goes into the
+ * thread cache.  A size larger than the block's breaks the heap, unless
+ * myHeap.c is built with MYHEAP_HARDENED, where it is checked.
+ */
+int myFreeSized(void *ptr, size_t size) {
+    sampleFree(ptr);
+    return freeSized(ownerHeap(ptr), ptr, size);
+}
+ 
+ 
+
+/*
+ * Function for allocating 'size' bytes whose address is a multiple of
+ * 'alignment'.
+ * Argument size: requested size for the payload
+ * Argument alignment: required alignment, a power of two
+ * Returns address of the aligned payload on success.
+ * Returns NULL if size is 0, if alignment is not a power of two, or if
+ * the memory cannot be allocated.
+ *
+ * The space in front of the aligned block is split off as a free block,
+ * so none of it is lost, and the result is freed with myFree as usual.
+ * Alignments of 8 or less are what myAlloc already gives.  myRealloc
+ * keeps the alignment only while it resizes the block in place.
+ */
+void* myAllocAligned(size_t size, size_t alignment) {
+    myHeap_t *heap = localHeap();
+    blockHeader *block;
+    size_t padded;
+
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        return NULL;
+    }
+    if (alignment <= 8) {
+        return myAlloc(size);
+    }
+    if (size == 0 || size > SIZE_MAX / 4 || alignment > SIZE_MAX / 4) {
+        return NULL;
+    }
+    if (heap->mmapThreshold != 0 && size >= heap->mmapThreshold) {
+        return sampled(hugeAlloc(heap, size, alignment), size);
+    }
+
+    padded = (sizeof(blockHeader) + size + 7) / 8 * 8;
+    if (__atomic_load_n(&heap->size, __ATOMIC_RELAXED) < padded + alignment && !heap->growOn) {
+        countFailure(heap);
+        return NULL;
+    }
+    pthread_mutex_lock(&heap->lock);
+    drainRemote(heap);
+    block = allocAlignedBlock(heap, padded, alignment, sizeof(blockHeader));
+    countResult(heap, block != NULL);
+    pthread_mutex_unlock(&heap->lock);
+    if (block == NULL) {
+        return NULL;
+    }
+    return sampled((char *)block + sizeof(blockHeader), size);
+}
+
+/*
+ * Zeroes the bytes from 'from' up to 'to', if there are any.
+ */
+static void clearRange(char *from, char *to) {
+    if (from < to) {
+        memset(from, 0, to - from);
+    }
+}
+
+/*
+ * Zeroes the bytes from 'from' up to 'to' that lie outside the pages from
+ * 'lo' up to 'hi', which are known to be zero already.
+ */
+static void clearAround(char *from, char *to, char *lo, char *hi) {
+    if (lo < hi) {
+        clearRange(from, to < lo ? to : lo);
+        clearRange(from > hi ? from : hi, to);
+    } else {
+        clearRange(from, to);
+    }
+}
+
+/*
+ * Allocates 'total' zeroed bytes aligned to 'alignment' from 'heap', for
+ * myCalloc and myCallocAligned, which sample the result.  Returns NULL
+ * if the memory cannot be allocated.
+ *
+ * Heap memory starts out zeroed, so only the part of the block below its
+ * region's high-water mark is cleared, plus the words where a header,
+ * links or a footer may have been kept above it, and the part from the
+ * region's carve mark up.  Pages that coalesce() gave back are zero as
+ * well and are skipped too.  This holds for the
+ * free block found as a whole, so it holds for an aligned block cut out
+ * of it as well.
+ */
+static void *allocZeroed(myHeap_t *heap, size_t total, size_t alignment) {
+    size_t padded;
+    blockHeader *block;
+    heapRegion *region;
+    char *highWater;
+    char *carveLow;
+    char *payload;
+    char *end;
+    char *dirty;
+    char *lo;
+    char *hi;
+    int released;
+
+    if (heap->mmapThreshold != 0 && total >= heap->mmapThreshold) {
+        return hugeAlloc(heap, total, alignment);
+    }
+    if (alignment <= 8 &&
+        ((threadCacheOn && total <= TCACHE_MAX_SIZE) || (heap->slabOn && total <= SLAB_MAX_SIZE))) {
+        payload = myHeapAlloc(heap, total);
+        if (payload != NULL) {
+            memset(payload, 0, total);
+        }
+        return payload;
+    }
+
+    padded = (sizeof(blockHeader) + total + 7) / 8 * 8;
+    if (__atomic_load_n(&heap->size, __ATOMIC_RELAXED) < alignedFitSize(padded, alignment) &&
+        !heap->growOn) {
+        countFailure(heap);
+        return NULL;
+    }
+    pthread_mutex_lock(&heap->lock);
+    drainRemote(heap);
+    block = findFit(heap, alignedFitSize(padded, alignment));
+    countResult(heap, block != NULL);
+    if (block == NULL) {
+        pthread_mutex_unlock(&heap->lock);
+        return NULL;
+    }
+    region = findRegion(heap, block + 1);
+    highWater = region->highWater;
+    carveLow = region->carveLow;
+    released = (statusOf(block) & 4) != 0;
+    interiorOf(block, region->pageSize, &lo, &hi);
+    removeFree(heap, block);
+    block = placeAligned(heap, block, padded, alignment, sizeof(blockHeader));
+    pthread_mutex_unlock(&heap->lock);
+
+    payload = (char *)block + sizeof(blockHeader);
+    end = payload + total;
+    // A header and links may still sit just above the mark
+    dirty = highWater + sizeof(blockHeader) + sizeof(freeLinks);
+    if (dirty > end) {
+        dirty = end;
+    }
+    if (!released) {
+        lo = hi = NULL;
+    }
+    clearAround(payload, dirty, lo, hi);
+    // Carve-high pieces may have been handed out up there
+    if (carveLow < dirty) {
+        carveLow = dirty;
+    }
+    clearAround(carveLow > payload ? carveLow : payload, end, lo, hi);
+    // An old footer may sit at the end of the block
+    clearRange((char *)block + blockSize(block) - sizeof(blockHeader), end);
+    return payload;
+}
+
+/*
+ * Function for allocating zeroed memory for an array.
+ * Argument count: number of elements
+ * Argument size: size of each element
+ * Returns address of the zeroed payload on success.
+ * Returns NULL if either argument is 0, if count * size overflows, or
+ * if the memory cannot be allocated.
+ *
+ * Only the part of the block that may not be zero yet is cleared, see
+ * allocZeroed().  Huge blocks are fresh anonymous mappings and are not
+ * cleared at all.  Small requests come from the thread cache or slabs
+ * and are always cleared.
+ */
+void* myCalloc(size_t count, size_t size) {
+    size_t total;
+
+    if (count == 0 || size == 0 || size > SIZE_MAX / 2 / count) {
+        return NULL;
+    }
+    total = count * size;
+    return sampled(allocZeroed(localHeap(), total, 8), total);
+}
+
+/*
+ * Function for allocating zeroed memory for an array at an aligned address.
+ * Argument count: number of elements
+ * Argument size: size of each element
+ * Argument alignment: a power of two the payload address is a multiple of
+ * Returns address of the zeroed payload on success.
+ * Returns NULL if alignment is not a power of two, as for myCalloc
+ * otherwise.
+ *
+ * Clears as little as myCalloc does.  Unlike myCalloc, small requests
+ * aligned to more than 8 bytes come from a heap block.
+ */
+void* myCallocAligned(size_t count, size_t size, size_t alignment) {
+    size_t total;
+
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment > SIZE_MAX / 4) {
+        return NULL;
+    }
+    if (count == 0 || size == 0 || size > SIZE_MAX / 4 / count) {
+        return NULL;
+    }
+    total = count * size;
+    return sampled(allocZeroed(localHeap(), total, alignment), total);
+}
+
+/*
+ * Function for allocating 'count' blocks of 'size' bytes at once.
+ * Argument size: requested size for each payload
+ * Argument count: number of blocks wanted
+ * Argument out: array of at least count entries for the payloads
+ * Returns the number of blocks allocated, which is less than count only
+ * if the heap ran out of memory.
+ *
+ * One search finds a free block large enough for all of the remaining
+ * blocks if there is one, and they are cut from it back to back.  If
+ * there is none, as many as fit are cut from the best fit for a single
+ * block and the search is repeated.  The blocks always come from the
+ * heap, never from the thread cache or slabs, and are freed with myFree
+ * or myFreeBatch.
+ */
+size_t myAllocBatch(size_t size, size_t count, void **out) {
+    myHeap_t *heap = localHeap();
+    size_t padded;
+    size_t done = 0;
+
+    if (size == 0 || size > SIZE_MAX / 2 || out == NULL) {
+        return 0;
+    }
+    if (heap->mmapThreshold != 0 && size >= heap->mmapThreshold) {
+        while (done < count && (out[done] = sampled(hugeAlloc(heap, size, 8), size)) != NULL) {
+            done++;
+        }
+        return done;
+    }
+    padded = (sizeof(blockHeader) + size + 7) / 8 * 8;
+    if (__atomic_load_n(&heap->size, __ATOMIC_RELAXED) < padded && !heap->growOn) {
+        countFailure(heap);
+        return 0;
+    }
+
+    pthread_mutex_lock(&heap->lock);
+    drainRemote(heap);
+    while (done < count) {
+        size_t want = count - done;
+        blockHeader *block = NULL;
+        if (want > 1 && want <= SIZE_MAX / 2 / padded) {
+            block = searchIndex(heap, padded * want);
+        }
+        if (block == NULL) {
+            block = findFit(heap, padded);
+            if (block == NULL) {
+                break;
+            }
+        }
+        removeFree(heap, block);
+        done += carveBlocks(heap, block, padded, want, out + done);
+    }
+    heap->stats.allocs += done;
+    if (done < count) {
+        heap->stats.failedAllocs++;
+    }
+    pthread_mutex_unlock(&heap->lock);
+    if (sampleInterval != 0) {
+        size_t i;
+        for (i = 0; i < done; i++) {
+            sampled(out[i], size);
+        }
+    }
+    return done;
+}
+
+/*
+ * Orders pointers by address for qsort().
+ */
+static int comparePtrs(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t)*(void * const *)a;
+    uintptr_t y = (uintptr_t)*(void * const *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Frees the sorted blocks ptrs[0..count) of 'heap' for myFreeBatch.
+ * Returns 0 on success, -1 if any entry is rejected.
+ */
+static int freeBatchIn(myHeap_t *heap, void **ptrs, size_t count) {
+    blockHeader *run = NULL;   // first block of the run being collected
+    heapRegion *region;
+    size_t runSize = 0;
+    size_t i;
+    int result = 0;
+
+    pthread_mutex_lock(&heap->lock);
+    for (i = 0; i < count; i++) {
+        void *ptr = ptrs[i];
+        blockHeader *block = (blockHeader *)((char *)ptr - sizeof(blockHeader));
+
+        if (ptr == NULL || ((uintptr_t)ptr) % 8 != 0 || (i > 0 && ptr == ptrs[i - 1])) {
+            result = -1; // NULL, misaligned or freed twice in this batch
+            continue;
+        }
+        region = findRegion(heap, ptr);
+        if (region == NULL) {
+            hugeHeader *huge = findHuge(heap, ptr);
+            if (huge != NULL) {
+                hugeFree(heap, huge);
+            } else {
+                result = -1;
+            }
+            continue;
+        }
+        if (!isLive(region, ptr)) { //Checks if the block is allocated, and a block at all
+            result = -1;
+            continue;
+        }
+        if (inSlabRun(region, ptr)) {
+            if (slabFree(heap, ptr) != 0) {
+                result = -1;
+            } else {
+                heap->stats.frees++;
+            }
+            continue;
+        }
+        heap->stats.frees++;
+        if (run != NULL && (char *)run + runSize == (char *)block) {
+            runSize += blockSize(block);
+            continue;
+        }
+        if (run != NULL) {
+            setStatus(run, runSize + (statusOf(run) & 2) + 1);
+            mergedInto(heap, run);
+            releaseBlock(heap, run);
+        }
+        run = block;
+        runSize = blockSize(block);
+    }
+    if (run != NULL) {
+        setStatus(run, runSize + (statusOf(run) & 2) + 1);
+        mergedInto(heap, run);
+        releaseBlock(heap, run);
+    }
+    pthread_mutex_unlock(&heap->lock);
+    return result;
+}
+
+/*
+ * Function for freeing many blocks at once.
+ * Argument ptrs: addresses of the blocks; the array is sorted in place
+ * Argument count: number of entries in ptrs
+ * Returns 0 on success.
+ * Returns -1 if any entry is rejected as myFree would reject it; the
+ * other entries are still freed.
+ *
+ * Sorting by address puts neighbouring blocks next to each other, so each
+ * run of adjacent blocks is freed as one block and listed once, in a
+ * single sweep under one lock.  Freed blocks skip the thread cache.
+ * With NUMA-local or hinted heaps, each run of entries owned by the
+ * same heap is freed that way in turn.
+ */
+int myFreeBatch(void **ptrs, size_t count) {
+    size_t start = 0;
+    size_t i;
+    int result = 0;
+
+    if (ptrs == NULL) {
+        return -1;
+    }
+    qsort(ptrs, count, sizeof(void *), comparePtrs);
+    if (samples != NULL) {
+        for (i = 0; i < count; i++) {
+            sampleFree(ptrs[i]);
+        }
+    }
+    if (!__atomic_load_n(&sideHeapsMade, __ATOMIC_ACQUIRE)) {
+        return freeBatchIn(&defaultHeap, ptrs, count);
+    }
+    while (start < count) {
+        myHeap_t *heap = ownerHeap(ptrs[start]);
+        for (i = start + 1; i < count && ownerHeap(ptrs[i]) == heap; i++) {
+        }
+        if (freeBatchIn(heap, ptrs + start, i - start) != 0) {
+            result = -1;
+        }
+        start = i;
+    }
+    return result;
+}
+
+/*
+ * Shrinks an allocated block to 'size' bytes (already padded, header
+ * included) and frees the tail if it is at least minRemainder() bytes.
+ * Caller must hold the heap's lock.
+ */
+static void trimBlock(myHeap_t *heap, blockHeader *block, size_t size) {
+    size_t current = blockSize(block);
+
+    if (current < size + minRemainder(heap)) {
+        return;
+    }
+    __atomic_fetch_sub(&block->size_status, current - size, __ATOMIC_RELAXED);
+    blockHeader *tail = (blockHeader *)((char *)block + size);
+    setStatus(tail, (current - size) + 2 + 1); // allocated for releaseBlock
+    releaseBlock(heap, tail);
+}
+
+/*
+ * Tries to resize an allocated block in place to 'size' bytes (already
+ * padded, header included), growing it into the next block when that one
+ * is free and large enough.  Returns 1 on success, 0 if the block has to
+ * move.  Caller must hold the heap's lock.
+ */
+static int resizeBlock(myHeap_t *heap, blockHeader *block, size_t size) {
+    size_t current = blockSize(block);
+
+    if (size > current) {
+        blockHeader *next = nextBlockOf(block);
+        if (!isFreeBlock(next) || current + blockSize(next) < size) {
+            return 0;
+        }
+        removeFree(heap, next);
+        heap->stats.usedBytes += blockSize(next);
+        __atomic_fetch_add(&block->size_status, blockSize(next), __ATOMIC_RELAXED);
+        mergedInto(heap, block);
+        setPrevAllocated(nextBlockOf(block), 1); // its previous block is allocated now
+        touchRegion(heap, block);
+    }
+    trimBlock(heap, block, size);
+    return 1;
+}
+
+/*
+ * Function for resizing a previously allocated block.
+ * Argument ptr: address of the block, or NULL to allocate a new one.
+ * Argument size: new payload size; 0 frees the block.
+ * Returns the address of the resized block on success, which may differ
+ * from ptr.  Returns NULL on failure, leaving the block untouched.
+ *
+ * This function:
+ * - Shrinks a block in place, splitting off the tail as a free block
+ *   when it is large enough to be one.
+ * - Grows a block in place by absorbing the next block when that one is
+ *   free and large enough, splitting off what is not needed.
+ * - Keeps a slab slot when the new size still fits in it, and remaps a
+ *   huge block with mremap.
+ * - Otherwise allocates a new block, copies the payload and frees the
+ *   old block.
+ */
+void* myRealloc(void *ptr, size_t size) {
+    myHeap_t *heap;
+    heapRegion *region;
+    size_t padded;
+    size_t oldSize;
+    void *moved;
+
+    if (ptr == NULL) {
+        return myAlloc(size);
+    }
+    if (size == 0) {
+        myFree(ptr);
+        return NULL;
+    }
+    if (((uintptr_t)ptr) % 8 != 0 || size > SIZE_MAX / 2) {
+        return NULL;
+    }
+    heap = ownerHeap(ptr);
+    region = findRegion(heap, ptr);
+
+    if (region == NULL) {
+        sampleFree(ptr); // mremap may move it, so it is no longer followed
+        pthread_mutex_lock(&heap->lock);
+        hugeHeader *huge = findHuge(heap, ptr);
+        if (huge != NULL) {
+            size_t pagesize = getpagesize();
+            size_t lead = huge->lead;
+            size_t mapSize = (lead + sizeof(hugeHeader) + size + pagesize - 1) / pagesize * pagesize;
+            hugeHeader *remapped = remapHuge(huge, mapSize);
+            if (remapped != NULL) {
+                heap->stats.hugeBytes += mapSize - remapped->mapSize;
+                remapped->mapSize = mapSize;
+                remapped->header.size_status =
+                    (mapSize - lead - offsetof(hugeHeader, header)) + 2 + 1;
+                if (remapped->prev != NULL) {
+                    remapped->prev->next = remapped;
+                } else {
+                    heap->hugeBlocks = remapped;
+                }
+                if (remapped->next != NULL) {
+                    remapped->next->prev = remapped;
+                }
+            }
+            huge = remapped;
+        }
+        pthread_mutex_unlock(&heap->lock);
+        return huge != NULL ? (void *)(huge + 1) : NULL;
+    }
+
+    if (!isLive(region, ptr)) { //Checks if the block is allocated, and a block at all
+        return NULL;
+    }
+    if (inSlabRun(region, ptr)) {
+        oldSize = usableSize(heap, ptr);
+        if (size <= oldSize) {
+            return ptr;
+        }
+    } else {
+        blockHeader *block = (blockHeader *)((char *)ptr - sizeof(blockHeader));
+        padded = (sizeof(blockHeader) + size + 7) / 8 * 8;
+        pthread_mutex_lock(&heap->lock);
+        int resized = resizeBlock(heap, block, padded);
+        pthread_mutex_unlock(&heap->lock);
+        if (resized) {
+            return ptr;
+        }
+        oldSize = blockSize(block) - sizeof(blockHeader);
+    }
+
+    moved = myAllocHint(size, heap->hint); // stays with its lifetime
+    if (moved == NULL) {
+        return NULL;
+    }
+    memcpy(moved, ptr, oldSize < size ? oldSize : size);
+    myFree(ptr);
+    return moved;
+}
+
+/*
+ * Returns the number of bytes usable at 'ptr' if it is a slot, block or
+ * huge block in use in 'heap', or 0.  Takes no lock: the ownership map
+ * finds the region or huge block, and isLive() checks a block.
+ */
+static size_t liveSize(myHeap_t *heap, void *ptr) {
+    heapRegion *region;
+    hugeHeader *huge;
+
+    if (ptr == NULL || ((uintptr_t)ptr) % 8 != 0) {
+        return 0;
+    }
+    region = findRegion(heap, ptr);
+    if (region == NULL) {
+        huge = findHuge(heap, ptr);
+        return huge != NULL ? blockSize(&huge->header) - sizeof(blockHeader) : 0;
+    }
+    if (!isLive(region, ptr)) {
+        return 0;
+    }
+    return usableSize(heap, ptr);
+}
+
+/*
+ * Function for getting the number of bytes usable at an allocated address.
+ * Argument ptr: address returned by one of the allocation functions
+ * Returns the usable size, which may be more than was asked for.
+ * Returns 0 if ptr is NULL or not allocated from the default heap.
+ */
+size_t myUsableSize(void *ptr) {
+    return liveSize(ownerHeap(ptr), ptr);
+}
+
+/*
+ * Function for checking whether an address was allocated from the
+ * default heap and is not freed.
+ * Argument ptr: address to check, which may be any pointer
+ * Returns 1 if ptr is a slot, block or huge block in use, 0 otherwise.
+ *
+ * The default heap takes in the node and hint heaps it hands out memory
+ * from, but not the heaps of myHeapCreate and myHeapOpen; see
+ * myHeapOwns for those.  One lookup in the ownership map finds the
+ * region, then for a block this is the check myFree makes, see isLive():
+ * a few words are read and no lock is taken.  Memory held in a thread
+ * cache counts as in use.
+ */
+int myOwns(void *ptr) {
+    return liveSize(ownerHeap(ptr), ptr) != 0;
+}
+
+/*
+ * Function for checking whether an address was allocated from a given
+ * heap and is not freed.
+ * Argument heap: heap to check
+ * Argument ptr: address to check, which may be any pointer
+ * Returns 1 if ptr is a slot, block or huge block in use in that heap,
+ * 0 otherwise.
+ *
+ * Like myOwns, but for that heap alone: for the default heap, memory of
+ * its node and hint heaps does not count.
+ */
+int myHeapOwns(myHeap_t *heap, void *ptr) {
+    if (heap == NULL) {
+        return 0;
+    }
+    return liveSize(heap, ptr) != 0;
+}
+
+/*
+ * Arenas for memory that is freed all at once.
+ *
+ * An arena is one block carved out of a heap.  Its payload starts with a
+ * myArena descriptor; the rest is handed out by bumping 'next', with no
+ * search, no split and no per-object free.  Rewinding or resetting only
+ * moves 'next' back, and releasing the arena frees the block, so the heap
+ * gets everything back as one free block.  An arena is not locked: it
+ * must only be used by one thread at a time.
+ */
+struct myArena {
+    myHeap_t *heap;            // heap the arena block came from
+    char *next;                // first byte not handed out yet
+    char *end;                 // end of the arena's space
+};
+
+/*
+ * Function for creating an arena in the default heap.
+ * Argument size: number of bytes the arena can hand out
+ * Returns the arena on success.
+ * Returns NULL if size is 0 or the heap has no block that large.
+ */
+myArena_t* myArenaCreate(size_t size) {
+    myArena_t *arena;
+
+    if (size == 0 || size > SIZE_MAX / 2) {
+        return NULL;
+    }
+    arena = myHeapAlloc(&defaultHeap, sizeof(myArena_t) + (size + 7) / 8 * 8);
+    if (arena == NULL) {
+        return NULL;
+    }
+    arena->heap = &defaultHeap;
+    arena->next = (char *)(arena + 1);
+    arena->end = arena->next + (size + 7) / 8 * 8;
+    return arena;
+}
+
+/*
+ * Function for allocating 'size' bytes from an arena.
+ * Argument arena: arena to allocate from
+ * Argument size: requested size
+ * Returns the address of the memory, a multiple of 8, on success.
+ * Returns NULL if size is 0 or the arena does not have that much left.
+ */
+void* myArenaAlloc(myArena_t *arena, size_t size) {
+    char *ptr = arena->next;
+
+    // What is left is a multiple of 8, so rounding up still fits
+    if (size == 0 || size > (size_t)(arena->end - ptr)) {
+        return NULL;
+    }
+    arena->next = ptr + (size + 7) / 8 * 8;
+    return ptr;
+}
+
+/*
+ * Function for remembering how much of an arena is in use.
+ * Argument arena: the arena
+ * Returns a mark for myArenaRewind.
+ */
+size_t myArenaMark(myArena_t *arena) {
+    return arena->next - (char *)(arena + 1);
+}
+
+/*
+ * Function for freeing everything allocated from an arena since 'mark'
+ * was taken, for nested scopes.
+ * Argument arena: the arena
+ * Argument mark: value returned by myArenaMark; marks taken after a
+ *   later point are no longer valid once it is rewound past them
+ */
+void myArenaRewind(myArena_t *arena, size_t mark) {
+    char *ptr = (char *)(arena + 1) + mark;
+
+    if (ptr < arena->next) {
+        arena->next = ptr;
+    }
+}
+
+/*
+ * Function for freeing everything allocated from an arena in O(1).
+ * The arena keeps its block and can be used again.
+ */
+void myArenaReset(myArena_t *arena) {
+    arena->next = (char *)(arena + 1);
+}
+
+/*
+ * Function for destroying an arena.  Its whole block goes back to the
+ * heap it came from as one free block.
+ */
+void myArenaRelease(myArena_t *arena) {
+    if (arena != NULL) {
+        myHeapFree(arena->heap, arena);
+    }
+}
+
+/*
+ * Merges every run of adjacent free blocks.  Caller must hold the heap's lock.
+ */
+static void coalesceAll(myHeap_t *heap) {
+    heapRegion *region;
+    blockHeader *currentBlock;
+
+    for (region = heap->regions; region != NULL; region = region->next) {
+        for (currentBlock = region->first; statusOf(currentBlock) != 1;
+             currentBlock = nextBlockOf(currentBlock)) {
+            //Checks if the block and the one after it are free
+            if (isFreeBlock(currentBlock) && isFreeBlock(nextBlockOf(currentBlock))) {
+                // Relist the block once after absorbing the whole free run
+                removeFree(heap, currentBlock);
+                while (isFreeBlock(nextBlockOf(currentBlock))) {
+                    absorbNext(heap, currentBlock);
+                }
+                writeFooter(currentBlock);
+                insertFree(heap, currentBlock);
+            }
+        }
+    }
+}
+
+/*
+ * Coalesces one heap for coalesce() and gives pages back.
+ */
+static void coalesceHeap(myHeap_t *heap) {
+    pthread_mutex_lock(&heap->lock);
+    drainRemote(heap);
+    coalesceAll(heap);
+    if (heap->releaseThreshold != 0) {
+        releaseFreePages(heap);
+    }
+    pthread_mutex_unlock(&heap->lock);
+}
+
+/*
+ * Function for traversing heap block list and coalescing all adjacent 
+ * free blocks.
+ *
+ * This function is used for delayed coalescing; with
+ * MYHEAP_COALESCE_IMMEDIATE myFree already keeps free blocks merged.
+ * Updated header size_status and footer size_status as needed.
+ * With MYHEAP_OPT_RELEASE_THRESHOLD set, the pages inside large free
+ * blocks are then given back to the system.  NUMA-local heaps and the
+ * heaps of myAllocHint are coalesced as well.
+ */
+int coalesce() {
+    int slot;
+
+    coalesceHeap(&defaultHeap);
+    for (slot = 0; slot < SIDE_HEAPS; slot++) {
+        myHeap_t *heap = __atomic_load_n(&sideHeaps[slot], __ATOMIC_ACQUIRE);
+        if (heap != NULL) {
+            coalesceHeap(heap);
+        }
+    }
+    return 0; 
+}
+
+/*
+ * Walks part of the heap for coalesceStep and the scavenger.  When
+ * 'releaseGoal' is not NULL, the pages inside free blocks passed on the
+ * way are also given back until that many bytes are, counting it down.
+ * Returns 1 once a pass over the whole heap is completed, else 0.
+ */
+static int stepHeap(myHeap_t *heap, size_t maxBlocks, unsigned long maxNanos, size_t *releaseGoal) {
+    struct timespec start;
+    struct timespec now;
+    size_t looked = 0;
+    int done;
+
+    if (maxNanos != 0) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+    }
+    pthread_mutex_lock(&heap->lock);
+    drainRemote(heap);
+    drainPending(heap);
+    if (heap->cursor == NULL && heap->regions != NULL) {
+        heap->cursorRegion = heap->regions;
+        heap->cursor = heap->cursorRegion->first;
+    }
+    while (heap->cursor != NULL) {
+        blockHeader *block = heap->cursor;
+        if (statusOf(block) == 1) { // end mark, go on with the next region
+            heap->cursorRegion = heap->cursorRegion->next;
+            heap->cursor = heap->cursorRegion != NULL ? heap->cursorRegion->first : NULL;
+            continue;
+        }
+        if (isFreeBlock(block) && isFreeBlock(nextBlockOf(block))) {
+            removeFree(heap, block);
+            while (isFreeBlock(nextBlockOf(block))) {
+                absorbNext(heap, block);
+                looked++;
+            }
+            writeFooter(block);
+            insertFree(heap, block);
+        }
+        if (releaseGoal != NULL && *releaseGoal != 0 && isFreeBlock(block) &&
+            (statusOf(block) & 4) == 0) {
+            char *lo;
+            char *hi;
+            interiorOf(block, heap->cursorRegion->pageSize, &lo, &hi);
+            if (lo < hi && madvise(lo, hi - lo, MADV_DONTNEED) == 0) {
+                setStatus(block, statusOf(block) + 4);
+                heap->stats.releasedBytes += hi - lo;
+                *releaseGoal -= (size_t)(hi - lo) < *releaseGoal ? (size_t)(hi - lo) : *releaseGoal;
+            }
+        }
+        heap->cursor = nextBlockOf(block);
+        looked++;
+        if (maxBlocks != 0 && looked >= maxBlocks) {
+            break;
+        }
+        if (maxNanos != 0 && looked % 64 == 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if ((unsigned long)((now.tv_sec - start.tv_sec) * 1000000000L +
+                                (now.tv_nsec - start.tv_nsec)) >= maxNanos) {
+                break;
+            }
+        }
+    }
+    done = heap->cursor == NULL;
+    pthread_mutex_unlock(&heap->lock);
+    return done;
+}
+
+/*
+ * Function for coalescing part of the heap, carrying on where the last
+ * call stopped.
+ * Argument maxBlocks: blocks to look at before returning, 0 for no limit
+ * Argument maxNanos: nanoseconds to spend before returning, 0 for no limit
+ * Returns 1 if a pass over the whole heap has been completed.
+ * Returns 0 if there is more to do.
+ *
+ * Blocks queued in MYHEAP_COALESCE_PENDING mode are merged first.  Then
+ * the walk merges runs of adjacent free blocks like coalesce() does, so
+ * calling it until it returns 1 has the effect of one coalesce() spread
+ * over short pauses.  Blocks freed behind the cursor wait for the next
+ * pass.  The time is checked every 64 blocks.  No pages are given back,
+ * and only the default heap is walked, not NUMA-local or hinted heaps.
+ */
+int coalesceStep(size_t maxBlocks, unsigned long maxNanos) {
+    return stepHeap(&defaultHeap, maxBlocks, maxNanos, NULL);
+}
+
+/*
+ * Background scavenger (MYHEAP_OPT_SCAVENGE).
+ *
+ * A thread that wakes every scavengeMillis milliseconds and does, for the
+ * default heap, the upkeep that would otherwise land on callers:
+ * - one stretch of an incremental coalescing pass, in up to
+ *   SCAVENGE_SLICES slices of SCAVENGE_BLOCKS blocks, each under its own
+ *   hold of the heap's lock;
+ * - while the process' resident memory is above scavengeTarget bytes
+ *   (MYHEAP_OPT_SCAVENGE_RSS), giving the pages inside free blocks it
+ *   walks past back to the system;
+ * - refilling the thread cache depot for the classes that missed.
+ * The lock is never held for more than one slice or one class, so a
+ * caller waits for at most that long.  NUMA-local heaps are left alone.
+ */
+#define SCAVENGE_SLICES 16
+#define SCAVENGE_BLOCKS 256
+
+static pthread_mutex_t scavengeLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scavengeWake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t scavengeJoined = PTHREAD_COND_INITIALIZER; // scavengeStopping cleared
+static pthread_t scavengeThread;
+static int scavengeRunning = 0;  // the thread exists
+static int scavengeStop = 0;     // asks it to exit
+static int scavengeStopping = 0; // a caller is joining the thread that was asked
+static long scavengeMillis = 0;
+static size_t scavengeTarget = 0; // 0 never trims
+
+/*
+ * Returns the resident memory of the process in bytes, or 0 if it cannot
+ * be read.
+ */
+static size_t residentBytes() {
+    char text[128];
+    int fd = open("/proc/self/statm", O_RDONLY);
+    ssize_t got;
+    size_t pages = 0;
+    char *c;
+
+    if (fd < 0) {
+        return 0;
+    }
+    got = read(fd, text, sizeof(text) - 1);
+    close(fd);
+    if (got <= 0) {
+        return 0;
+    }
+    text[got] = '\0';
+    c = strchr(text, ' '); // skip the total size
+    if (c == NULL) {
+        return 0;
+    }
+    for (c++; *c >= '0' && *c <= '9'; c++) {
+        pages = pages * 10 + *c - '0';
+    }
+    return pages * getpagesize();
+}
+
+/*
+ * Carves depot batches for each class that missed since the last round,
+ * or empties the depot once the thread caches are off.
+ */
+static void refillDepot(myHeap_t *heap) {
+    int class;
+
+    for (class = 0; class < TCACHE_CLASSES; class++) {
+        if (!threadCacheOn) {
+            pthread_mutex_lock(&heap->lock);
+            depotFlush(heap);
+            pthread_mutex_unlock(&heap->lock);
+            return;
+        }
+        if (__atomic_load_n(&depotMisses[class], __ATOMIC_RELAXED) == 0) { // a hint only
+            continue;
+        }
+        pthread_mutex_lock(&heap->lock);
+        __atomic_store_n(&depotMisses[class], 0, __ATOMIC_RELAXED);
+        while (depotCount[class] < DEPOT_BATCHES) {
+            void *batch = NULL;
+            if (carveBatch(heap, class, &batch) != TCACHE_BATCH) {
+                while (batch != NULL) { // the heap is full, give it back
+                    void *next = *(void **)batch;
+                    releasePtr(heap, batch);
+                    batch = next;
+                }
+                break;
+            }
+            depot[class][depotCount[class]++] = batch;
+        }
+        pthread_mutex_unlock(&heap->lock);
+    }
+}
+
+/*
+ * Body of the scavenger thread.
+ */
+static void *scavengeMain(void *arg) {
+    myHeap_t *heap = &defaultHeap;
+    struct timespec wake;
+    int slice;
+
+    (void)arg;
+    pthread_mutex_lock(&scavengeLock);
+    while (!scavengeStop) {
+        size_t goal = 0;
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_sec += scavengeMillis / 1000;
+        wake.tv_nsec += scavengeMillis % 1000 * 1000000L;
+        if (wake.tv_nsec >= 1000000000L) {
+            wake.tv_sec++;
+            wake.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&scavengeWake, &scavengeLock, &wake);
+        if (scavengeStop) {
+            break;
+        }
+        if (scavengeTarget != 0) {
+            size_t resident = residentBytes();
+            goal = resident > scavengeTarget ? resident - scavengeTarget : 0;
+        }
+        pthread_mutex_unlock(&scavengeLock);
+
+        for (slice = 0; slice < SCAVENGE_SLICES; slice++) {
+            if (stepHeap(heap, SCAVENGE_BLOCKS, 0, goal != 0 ? &goal : NULL) && goal == 0) {
+                break; // a pass is done and nothing more to give back
+            }
+        }
+        refillDepot(heap);
+        pthread_mutex_lock(&scavengeLock);
+    }
+    pthread_mutex_unlock(&scavengeLock);
+    return NULL;
+}
+
+/*
+ * Starts, retunes or stops the scavenger (MYHEAP_OPT_SCAVENGE) to wake
+ * every 'millis' milliseconds, 0 to stop it.  Returns 0 on success, -1
+ * if the thread cannot be started.
+ *
+ * The caller that stops the thread joins it without holding the lock;
+ * a start in the meantime waits for that join, so only one scavenger
+ * ever runs and each one is joined once.
+ */
+static int setScavenger(long millis) {
+    pthread_t stopped;
+    int result = 0;
+    int join = 0;
+
+    pthread_mutex_lock(&scavengeLock);
+    if (millis != 0) {
+        while (scavengeStopping) {
+            pthread_cond_wait(&scavengeJoined, &scavengeLock);
+        }
+        scavengeMillis = millis;
+        if (!scavengeRunning) {
+            scavengeStop = 0;
+            if (pthread_create(&scavengeThread, NULL, scavengeMain, NULL) == 0) {
+                scavengeRunning = 1;
+            } else {
+                result = -1;
+            }
+        }
+    } else if (scavengeRunning) {
+        scavengeStop = 1;
+        scavengeRunning = 0;
+        scavengeStopping = 1;
+        stopped = scavengeThread;
+        join = 1;
+    }
+    pthread_cond_signal(&scavengeWake);
+    pthread_mutex_unlock(&scavengeLock);
+    if (join) {
+        pthread_join(stopped, NULL);
+        pthread_mutex_lock(&defaultHeap.lock);
+        depotFlush(&defaultHeap);
+        pthread_mutex_unlock(&defaultHeap.lock);
+        pthread_mutex_lock(&scavengeLock);
+        scavengeStopping = 0;
+        pthread_cond_broadcast(&scavengeJoined);
+        pthread_mutex_unlock(&scavengeLock);
+    }
+    return result;
+}
+
+/*
+ * fork() handlers registered by myInit.  The default heap's locks, and
+ * those of the node and hint heaps and the scavenger, are held across the fork, so a child never inherits a heap that another
+ * thread was in the middle of changing.  The child's copy of the other
+ * threads' caches is lost, which only leaks their cached blocks.
+ */
+static void forkPrepare() {
+    int slot;
+
+    pthread_mutex_lock(&scavengeLock);
+    pthread_mutex_lock(&numaLock);
+    pthread_mutex_lock(&defaultHeap.lock);
+    for (slot = 0; slot < SIDE_HEAPS; slot++) {
+        if (sideHeaps[slot] != NULL) {
+            pthread_mutex_lock(&sideHeaps[slot]->lock);
+        }
+    }
+    pthread_mutex_lock(&sampleLock);
+    pthread_mutex_lock(&ownerLock);
+}
+
+static void forkRelease() {
+    int slot;
+
+    pthread_mutex_unlock(&ownerLock);
+    pthread_mutex_unlock(&sampleLock);
+    for (slot = SIDE_HEAPS - 1; slot >= 0; slot--) {
+        if (sideHeaps[slot] != NULL) {
+            pthread_mutex_unlock(&sideHeaps[slot]->lock);
+        }
+    }
+    pthread_mutex_unlock(&defaultHeap.lock);
+    pthread_mutex_unlock(&numaLock);
+    pthread_mutex_unlock(&scavengeLock);
+}
+
+/*
+ * fork() handler for the child, where only the forking thread lives on:
+ * the scavenger is gone, and turning it on again starts a new one.
+ */
+static void forkChild() {
+    scavengeRunning = 0;
+    scavengeStopping = 0; // the parent joins its own thread
+    pthread_cond_init(&scavengeWake, NULL); // may still count the parent's waiter
+    pthread_cond_init(&scavengeJoined, NULL);
+    forkRelease();
+}
  
 /* 
  * Function used to initialize the memory allocator.
@@ -249,14 +3881,16 @@ return 0;
  * Returns 0 on success.
  * Returns -1 on failure.
  */                    
-int myInit(int sizeOfRegion) {    
+int myInit(size_t sizeOfRegion) {    
  
     static int allocated_once = 0; //prevent multiple myInit calls
  
-    int pagesize;   // page size
-    int padsize;    // size of padding when heap size not a multiple of page size
+    size_t pagesize; // page size
+    size_t padsize;  // size of padding when heap size not a multiple of page size
     void* mmap_ptr; // pointer to memory mapped area
     int fd;
+    int backing = MYHEAP_PAGES_SMALL;
+    myHeap_t *heap = &defaultHeap;
 
     blockHeader* endMark;
   
@@ -266,13 +3900,16 @@ int myInit(int sizeOfRegion) {
         return -1;
     }
 
-    if (sizeOfRegion <= 0) {
+    if (sizeOfRegion == 0 || sizeOfRegion > SIZE_MAX / 2) {
         fprintf(stderr, "Error:mem.c: Requested block size is not positive\n");
         return -1;
     }
 
     // Get the pagesize
     pagesize = getpagesize();
+    if (heap->hugePagesOn) {
+        pagesize = HUGE_PAGE_SIZE;
+    }
 
     // Calculate padsize as the padding required to round up sizeOfRegion 
     // to a multiple of pagesize
@@ -282,26 +3919,43 @@ int myInit(int sizeOfRegion) {
     allocsize = sizeOfRegion + padsize;
 
     // Using mmap to allocate memory
-    fd = open("/dev/zero", O_RDWR);
-    if (-1 == fd) {
-        fprintf(stderr, "Error:mem.c: Cannot open /dev/zero\n");
-        return -1;
+    if (heap->hugePagesOn) {
+        mmap_ptr = mapHuge(allocsize, &backing);
+        if (NULL == mmap_ptr) {
+            mmap_ptr = MAP_FAILED;
+        }
+    } else {
+        fd = open("/dev/zero", O_RDWR);
+        if (-1 == fd) {
+            fprintf(stderr, "Error:mem.c: Cannot open /dev/zero\n");
+            return -1;
+        }
+        mmap_ptr = mmap(NULL, allocsize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);
     }
-    mmap_ptr = mmap(NULL, allocsize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
     if (MAP_FAILED == mmap_ptr) {
         fprintf(stderr, "Error:mem.c: mmap cannot allocate space\n");
         allocated_once = 0;
         return -1;
     }
+    // No block is written yet, and nothing can look for one before myInit returns
+    if (linkRegion(heap, &heap->firstRegion, mmap_ptr, allocsize, mmap_ptr, backing) != 0) {
+        fprintf(stderr, "Error:mem.c: cannot map the heap's pages to it\n");
+        munmap(mmap_ptr, allocsize);
+        return -1;
+    }
   
     allocated_once = 1;
+    heap->canarySecret = newCanarySecret();
+    pthread_atfork(forkPrepare, forkRelease, forkChild);
 
-    // for double word alignment and end mark
-    allocsize -= 8;
+    // for the end mark
+    allocsize -= sizeof(blockHeader);
 
     // Initially there is only one big free block in the heap.
-    // Skip first 4 bytes for double word alignment requirement.
-    heapStart = (blockHeader*) mmap_ptr + 1;
+    // Headers are 8 bytes, so a header at the page-aligned start of the
+    // mapping already leaves the payload double word aligned.
+    heapStart = (blockHeader*) mmap_ptr;
 
     // Set the end mark
     endMark = (blockHeader*)((void*)heapStart + allocsize);
@@ -315,12 +3969,689 @@ int myInit(int sizeOfRegion) {
     heapStart->size_status += 2;
 
     // Set the footer
-    blockHeader *footer = (blockHeader*) ((void*)heapStart + allocsize - 4);
+    blockHeader *footer = (blockHeader*) ((void*)heapStart + allocsize - sizeof(blockHeader));
     footer->size_status = allocsize;
+
+    // The whole heap starts out as the only listed free block
+    insertFree(heap, heapStart);
+    heap->size = allocsize;
   
     return 0;
 } 
+
+/*
+ * Function for creating a heap of its own, apart from the default heap.
+ * Argument size: the size of the heap space to be allocated.
+ * Returns the new heap on success.
+ * Returns NULL on failure.
+ *
+ * The heap starts out with the default options and its own lock.  Its
+ * blocks are allocated with myHeapAlloc and freed with myHeapFree;
+ * options are changed with myHeapSetOption.  Thread caches are never
+ * used for it.  The heap descriptor is kept at the start of the first
+ * mapping.
+ */
+myHeap_t* myHeapCreate(size_t size) {
+    return createHeap(size, -1);
+}
+
+
+/*
+ * Persistent heaps (myHeapOpen).
+ *
+ * A persistent heap lives in a file mapped MAP_SHARED.  The file starts
+ * with a fileHeader, followed by the heap descriptor and a single region
+ * of blocks, so the blocks, their links and the index are all in the
+ * file.  Block headers hold sizes only; the pointers in free
+ * links and in the descriptor are only valid at the address the file was
+ * mapped at, which the header records.
+ *
+ * Reopening a file that was closed with myHeapClose and mapping it at the
+ * same address again takes O(1): the header, the end mark and the first
+ * block are checked and the lock is set up anew.  Otherwise, when the
+ * address is taken or the file was not closed, every block is checked
+ * and the index is rebuilt from the block sizes, which are the same
+ * wherever the file is mapped.
+ *
+ * A persistent heap keeps to its one region: it cannot grow, and has no
+ * slabs, huge blocks, huge pages or page release, all of which would put
+ * memory outside the file.  Its lock is private to the process, and a
+ * file lock keeps other processes from opening it at the same time.
+ */
+#define FILE_MAGIC   0x6d7948656170ULL // "myHeap" in ASCII
+#define FILE_VERSION 1
+
+typedef struct fileHeader {
+    unsigned long long magic;
+    unsigned int version;
+    unsigned int clean;        // 1 once closed with myHeapClose
+    size_t headerSize;         // sizeof(fileHeader), to catch layout changes
+    size_t heapSize;           // sizeof(myHeap_t)
+    size_t mapSize;            // size of the file and its mapping
+    char *base;                // address the pointers in the file are valid at
+    size_t root;               // offset of the root block, 0 for none
+} fileHeader;
+
+#define FILE_HEAP_OFFSET ((sizeof(fileHeader) + 7) / 8 * 8)
+#define FILE_BLOCK_OFFSET (FILE_HEAP_OFFSET + (sizeof(myHeap_t) + 7) / 8 * 8)
+
+/*
+ * Walks the blocks of 'region' and checks that their sizes add up to the
+ * end mark, that each p-bit matches the block in front and that free
+ * blocks have their footer.  Adds the bytes of allocated blocks to 'used'.
+ * An allocated block still marked as queued by pushRemote() (bit2) was
+ * freed before the heap was last left; the queue is gone, so the free is
+ * finished here and the block becomes free, where isLive() would
+ * otherwise refuse it for good.
+ * Returns 0 if the layout is sound, -1 if not.
+ */
+static int checkLayout(heapRegion *region, size_t *used) {
+    blockHeader *current = region->first;
+    int prevAllocated = 1;
+
+    while (current != region->endMark) {
+        size_t size = blockSize(current);
+        if (statusOf(current) == 1 || size < MIN_BLOCK_SIZE ||
+            size > (size_t)((char *)region->endMark - (char *)current) ||
+            ((statusOf(current) & 2) != 0) != prevAllocated) {
+            return -1;
+        }
+        if (isFreeBlock(current)) {
+            if (statusOf((blockHeader *)((char *)current + size) - 1) != size) {
+                return -1;
+            }
+        } else if ((statusOf(current) & 4) != 0) {
+            blockHeader *next = (blockHeader *)((char *)current + size);
+            if (next != region->endMark && (statusOf(next) & 2) == 0) {
+                return -1;
+            }
+            setStatus(current, (statusOf(current) & ~HEADER_CANARY) - 4 - 1);
+            writeFooter(current);
+            setPrevAllocated(next, 0);
+        } else {
+            *used += size;
+        }
+        prevAllocated = !isFreeBlock(current);
+        current = nextBlockOf(current);
+    }
+    return statusOf(current) == 1 ? 0 : -1;
+}
+
+/*
+ * Points the descriptor of a persistent heap mapped at 'base' back at its
+ * own region and drops whatever cannot be trusted there, then checks the
+ * blocks and rebuilds the index.  Returns 0 on success, -1 if the blocks
+ * are not sound.
+ */
+static int relocateHeap(myHeap_t *heap, char *base, int clean) {
+    heapRegion *region = &heap->firstRegion;
+    char *oldBase = heap->file->base;
+    size_t used = 0;
+
+    region->next = NULL;
+    region->base = base;
+    region->mapSize = heap->file->mapSize;
+    region->first = (blockHeader *)(base + FILE_BLOCK_OFFSET);
+    region->endMark = (blockHeader *)(base + region->mapSize - sizeof(blockHeader));
+    region->slabMap = NULL;
+    if (clean && region->highWater >= oldBase + FILE_BLOCK_OFFSET &&
+        region->highWater <= oldBase + region->mapSize) {
+        region->highWater = base + (region->highWater - oldBase);
+    } else {
+        region->highWater = (char *)region->endMark; // clear everything in myCalloc
+    }
+    if (clean && region->carveLow >= oldBase + FILE_BLOCK_OFFSET &&
+        region->carveLow <= oldBase + region->mapSize) {
+        region->carveLow = base + (region->carveLow - oldBase);
+    } else {
+        region->carveLow = (char *)region->first;
+    }
+    heap->regions = region;
+    heap->size = region->mapSize - FILE_BLOCK_OFFSET - sizeof(blockHeader);
+    heap->hugeBlocks = NULL;
+    memset(heap->partialSlabs, 0, sizeof(heap->partialSlabs));
+    heap->pendingCount = 0; // those blocks are listed and merge later
+    heap->remoteFrees = NULL; // those blocks stay allocated
+    heap->cursorRegion = NULL;
+    heap->cursor = NULL;
+    if (checkLayout(region, &used) != 0) {
+        return -1;
+    }
+    heap->stats.usedBytes = used;
+    rebuildIndex(heap);
+    heap->file->base = base;
+    return 0;
+}
+
+/*
+ * Function for opening a persistent heap kept in a file, or making one.
+ * Argument path: the file; it is made if it does not exist
+ * Argument size: the size of the heap space of a new file; ignored when
+ * the file already holds a heap
+ * Returns the heap on success.
+ * Returns NULL if the file cannot be opened or mapped, is used by another
+ * process, or does not hold a sound heap.
+ *
+ * Blocks are allocated with myHeapAlloc and freed with myHeapFree as in
+ * any heap, and stay in the file across runs; myHeapRoot() finds them
+ * again.  Options are kept in the file too.  Close the heap with
+ * myHeapClose.
+ */
+myHeap_t* myHeapOpen(const char *path, size_t size) {
+    size_t pagesize = getpagesize();
+    fileHeader header;
+    struct stat st;
+    myHeap_t *heap;
+    char *base;
+    int fd;
+
+    if (path == NULL) {
+        return NULL;
+    }
+    fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    if (st.st_size == 0) {
+        // A new file: zero filled by ftruncate, laid out like createHeap
+        size_t mapSize;
+        if (size == 0 || size > SIZE_MAX / 2) {
+            close(fd);
+            return NULL;
+        }
+        mapSize = (FILE_BLOCK_OFFSET + size + sizeof(blockHeader) + pagesize - 1) / pagesize * pagesize;
+        if (ftruncate(fd, mapSize) != 0) {
+            close(fd);
+            return NULL;
+        }
+        base = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (MAP_FAILED == base) {
+            close(fd);
+            return NULL;
+        }
+        heap = (myHeap_t *)(base + FILE_HEAP_OFFSET);
+        pthread_mutex_init(&heap->lock, NULL);
+        heap->numaNode = -1;
+        heap->canarySecret = newCanarySecret();
+        heap->file = (fileHeader *)base;
+        heap->fileFd = fd;
+        if (formatRegion(heap, &heap->firstRegion, base, mapSize, FILE_BLOCK_OFFSET,
+                         MYHEAP_PAGES_SMALL) != 0) {
+            pthread_mutex_destroy(&heap->lock);
+            munmap(base, mapSize);
+            close(fd);
+            return NULL;
+        }
+        heap->file->magic = FILE_MAGIC;
+        heap->file->version = FILE_VERSION;
+        heap->file->headerSize = sizeof(fileHeader);
+        heap->file->heapSize = sizeof(myHeap_t);
+        heap->file->mapSize = mapSize;
+        heap->file->base = base;
+        return heap;
+    }
+
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != FILE_MAGIC ||
+        header.version != FILE_VERSION || header.headerSize != sizeof(fileHeader) ||
+        header.heapSize != sizeof(myHeap_t) || header.mapSize != (size_t)st.st_size ||
+        header.mapSize % pagesize != 0 || header.mapSize < FILE_BLOCK_OFFSET + MIN_BLOCK_SIZE + sizeof(blockHeader)) {
+        close(fd);
+        return NULL;
+    }
+    // Ask for the old address; the kernel only uses it if it is free
+    base = mmap(header.base, header.mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == base) {
+        close(fd);
+        return NULL;
+    }
+    heap = (myHeap_t *)(base + FILE_HEAP_OFFSET);
+#ifndef MYHEAP_HARDENED
+    if (heap->canarySecret != 0) { // its headers have canaries this build would read as size
+        munmap(base, header.mapSize);
+        close(fd);
+        return NULL;
+    }
+#endif
+    pthread_mutex_init(&heap->lock, NULL);
+    heap->file = (fileHeader *)base;
+    heap->fileFd = fd;
+    if (base != header.base || !header.clean ||
+        heap->firstRegion.first != (blockHeader *)(base + FILE_BLOCK_OFFSET) ||
+        statusOf(heap->firstRegion.endMark) != 1 ||
+        blockSize(heap->firstRegion.first) < MIN_BLOCK_SIZE) {
+        if (relocateHeap(heap, base, header.clean) != 0) {
+            pthread_mutex_destroy(&heap->lock);
+            munmap(base, header.mapSize);
+            close(fd);
+            return NULL;
+        }
+    }
+    heap->firstRegion.heap = heap;
+    if (setOwner(base, header.mapSize, &heap->firstRegion) != 0) {
+        pthread_mutex_destroy(&heap->lock);
+        munmap(base, header.mapSize);
+        close(fd);
+        return NULL;
+    }
+    heap->file->clean = 0; // until myHeapClose, which a crash never reaches
+    return heap;
+}
+
+/*
+ * Function for closing a persistent heap made by myHeapOpen.
+ * Argument heap: the heap to close
+ * Returns 0 on success.
+ * Returns -1 if the heap is not persistent or the file could not be
+ * written back.
+ *
+ * Queued frees are merged, the file is marked clean and written back, and
+ * the mapping and the file are closed.  No other thread may use the heap
+ * any more; its blocks stay valid in the file for the next myHeapOpen.
+ */
+int myHeapClose(myHeap_t *heap) {
+    fileHeader *file;
+    int fd;
+    int result;
+
+    if (heap == NULL || heap->file == NULL) {
+        return -1;
+    }
+    file = heap->file;
+    fd = heap->fileFd;
+    pthread_mutex_lock(&heap->lock);
+    drainRemote(heap);
+    drainPending(heap);
+    heap->cursor = NULL;
+    file->clean = 1;
+    pthread_mutex_unlock(&heap->lock);
+    pthread_mutex_destroy(&heap->lock);
+    setOwner((char *)file, file->mapSize, NULL);
+    result = msync(file, file->mapSize, MS_SYNC);
+    munmap(file, file->mapSize);
+    close(fd);
+    return result == 0 ? 0 : -1;
+}
+
+/*
+ * Function for recording the block a persistent heap is found from.
+ * Argument heap: a heap made by myHeapOpen
+ * Argument ptr: an allocated block of that heap, or NULL for none
+ * Returns 0 on success.
+ * Returns -1 if the heap is not persistent or ptr is not inside it.
+ *
+ * The block is stored as an offset, so it is found wherever the file is
+ * mapped next time.
+ */
+int myHeapSetRoot(myHeap_t *heap, void *ptr) {
+    if (heap == NULL || heap->file == NULL) {
+        return -1;
+    }
+    if (ptr != NULL && findRegion(heap, ptr) == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&heap->lock);
+    heap->file->root = ptr != NULL ? (size_t)((char *)ptr - (char *)heap->file) : 0;
+    pthread_mutex_unlock(&heap->lock);
+    return 0;
+}
+
+/*
+ * Function for finding the block recorded by myHeapSetRoot.
+ * Argument heap: a heap made by myHeapOpen
+ * Returns the block, or NULL if none was recorded or the heap is not
+ * persistent.
+ */
+void* myHeapRoot(myHeap_t *heap) {
+    if (heap == NULL || heap->file == NULL || heap->file->root == 0) {
+        return NULL;
+    }
+    return (char *)heap->file + heap->file->root;
+}
+
+/*
+ * Function for destroying a heap made by myHeapCreate, along with every
+ * block in it.
+ * Argument heap: the heap to destroy; the default heap is left alone.
+ *
+ * All of its memory goes back to the system at once, so its blocks need
+ * not be freed first.  No other thread may use the heap any more.
+ * A persistent heap from myHeapOpen is closed with myHeapClose instead,
+ * and its file is kept.
+ */
+void myHeapDestroy(myHeap_t *heap) {
+    heapRegion *region;
+    heapRegion *next;
+
+    if (heap == NULL || heap == &defaultHeap) {
+        return;
+    }
+    if (heap->file != NULL) {
+        myHeapClose(heap);
+        return;
+    }
+    while (heap->hugeBlocks != NULL) {
+        hugeFree(heap, heap->hugeBlocks);
+    }
+    for (region = heap->regions; region != NULL; region = next) {
+        next = region->next;
+        setOwner(region->base, region->mapSize, NULL);
+        if (region->slabMap != NULL) {
+            munmap(region->slabMap, slabMapSize(region));
+        }
+        if (region != &heap->firstRegion) { // holds the heap itself
+            munmap(region->base, region->mapSize);
+        }
+    }
+    pthread_mutex_destroy(&heap->lock);
+    munmap(heap->firstRegion.base, heap->firstRegion.mapSize);
+}
                   
+/*
+ * Function for changing an allocator option of a heap.
+ * Argument heap: heap to change
+ * Argument option: one of the MYHEAP_OPT_* constants in myHeap.h
+ * Argument value: new value for the option
+ * Returns 0 on success.
+ * Returns -1 if the option or the value is not valid.
+ *
+ * MYHEAP_OPT_INDEX selects the free-block index (MYHEAP_INDEX_*).  It may
+ * be changed at any time; free blocks are relisted under the new index.
+ *
+ * MYHEAP_OPT_COALESCE selects MYHEAP_COALESCE_DEFERRED, where free blocks
+ * are only merged by coalesce(), or MYHEAP_COALESCE_IMMEDIATE, where
+ * myFree merges a block with its free neighbours in constant time and
+ * adjacent free blocks never exist.  Switching to immediate mode runs
+ * coalesce() once so that this holds from then on.  MYHEAP_COALESCE_PENDING
+ * queues each freed block and, once PENDING_FREES of them are queued,
+ * merges them with their free neighbours in one go; switching away from
+ * it merges what is queued.
+ *
+ * MYHEAP_OPT_THREAD_CACHE turns the per-thread caches of small blocks on
+ * (non-zero) or off (0).  Only the default heap has them.  When turned off, each thread hands its cached
+ * blocks back on its next myAlloc or myFree call, or when it exits.
+ *
+ * MYHEAP_OPT_SLAB turns slab allocation of requests up to 128 bytes on
+ * (non-zero) or off (0).  Slots handed out earlier stay valid for myFree
+ * after it is turned off.
+ *
+ * MYHEAP_OPT_GROW lets myAlloc map another region when no free block is
+ * large enough (non-zero), or makes it return NULL as before (0).  Each
+ * new region is at least as large as the heap so far.
+ *
+ * MYHEAP_OPT_MMAP_THRESHOLD is the request size in bytes from which
+ * myAlloc maps a block of its own instead of using the heap; 0 (the
+ * default) never does.
+ *
+ * MYHEAP_OPT_RELEASE_THRESHOLD is the free block size in bytes from which
+ * coalesce() gives the pages inside the block back to the system; 0 (the
+ * default) keeps all pages.
+ *
+ * MYHEAP_OPT_HUGE_PAGES makes myInit and heap growth map regions on 2 MiB
+ * pages (non-zero), rounding them up to a multiple of 2 MiB, or on normal
+ * pages (0, the default).  Set it before myInit to cover the first region;
+ * myPageBacking() tells what was obtained.
+ *
+ * MYHEAP_OPT_PLACEMENT selects how the segregated index picks a block
+ * within a size class (MYHEAP_PLACE_*): best fit (the default), first
+ * fit, next fit from a roving pointer, or good fit, the smallest of the
+ * first MYHEAP_OPT_FIT_CANDIDATES blocks that fit (0 picks 8).  The TLSF
+ * index always takes the head of a fitting bin and ignores the policy.
+ *
+ * MYHEAP_OPT_MIN_REMAINDER is the smallest free block in bytes a split may
+ * leave; a block with less to spare is handed out whole.  0 (the default)
+ * splits whenever the rest can hold a header and a footer.
+ *
+ * MYHEAP_OPT_CARVE_HIGH is the request size in bytes, header included,
+ * below which a block is cut from the high end of the free block it is
+ * found in; larger ones, and all with 0 (the default), come from the low
+ * end.  Aligned and batch allocations always come from the low end.
+ *
+ * MYHEAP_OPT_SAMPLE_INTERVAL samples about one allocation in every
+ * 'value' bytes allocated from the default heap for myHeapProfile(); 0
+ * (the default) stops sampling.  Only the default heap is sampled.
+ *
+ * MYHEAP_OPT_NUMA makes the functions for the default heap allocate from
+ * a heap of the calling thread's NUMA node (non-zero), made on first use
+ * like the default heap and kept on that node, or from the default heap
+ * (0, the default).  Blocks always go back to the heap they came from,
+ * also after it is turned off.  Only the default heap takes it; see the
+ * NUMA-local heaps section for what stays with the default heap.
+ *
+ * MYHEAP_OPT_SCAVENGE starts a background thread that wakes every
+ * 'value' milliseconds to coalesce part of the default heap, give pages
+ * back and refill the thread caches' depot, or stops it (0, the default).
+ * MYHEAP_OPT_SCAVENGE_RSS is the resident size in bytes above which the
+ * scavenger gives back the pages inside free blocks; 0 (the default)
+ * keeps them.  Both take the default heap only.
+ *
+ * A persistent heap from myHeapOpen refuses MYHEAP_OPT_SLAB, GROW,
+ * MMAP_THRESHOLD, RELEASE_THRESHOLD and HUGE_PAGES.
+ */
+int myHeapSetOption(myHeap_t *heap, int option, long value) {
+    int result = 0;
+
+    if (option == MYHEAP_OPT_SAMPLE_INTERVAL) {
+        // Setting up may allocate inside backtrace(), so not under the lock
+        if (heap != &defaultHeap || value < 0 || (value != 0 && sampleSetup() != 0)) {
+            return -1;
+        }
+        sampleInterval = value;
+        return 0;
+    }
+    if (option == MYHEAP_OPT_SCAVENGE || option == MYHEAP_OPT_SCAVENGE_RSS) {
+        // Stopping waits for the thread, which takes the heap's lock
+        if (heap != &defaultHeap || value < 0) {
+            return -1;
+        }
+        if (option == MYHEAP_OPT_SCAVENGE) {
+            return setScavenger(value);
+        }
+        pthread_mutex_lock(&scavengeLock);
+        scavengeTarget = value;
+        pthread_mutex_unlock(&scavengeLock);
+        return 0;
+    }
+    if (option == MYHEAP_OPT_NUMA) {
+        if (heap != &defaultHeap) {
+            return -1;
+        }
+        if (value != 0 && numaNodes == 0) {
+            __atomic_store_n(&numaNodes, countNodes(), __ATOMIC_RELEASE);
+        }
+        __atomic_store_n(&numaOn, value != 0, __ATOMIC_RELEASE);
+        return 0;
+    }
+    if (heap->file != NULL && value != 0 &&
+        (option == MYHEAP_OPT_SLAB || option == MYHEAP_OPT_GROW || option == MYHEAP_OPT_MMAP_THRESHOLD ||
+         option == MYHEAP_OPT_RELEASE_THRESHOLD || option == MYHEAP_OPT_HUGE_PAGES)) {
+        return -1; // would put memory outside the file, see myHeapOpen
+    }
+    pthread_mutex_lock(&heap->lock);
+    switch (option) {
+    case MYHEAP_OPT_INDEX:
+        if (value != MYHEAP_INDEX_SEGREGATED && value != MYHEAP_INDEX_TLSF) {
+            result = -1;
+        } else if (value != heap->index.mode) {
+            heap->index.mode = value;
+            rebuildIndex(heap);
+        }
+        break;
+    case MYHEAP_OPT_COALESCE:
+        if (value != MYHEAP_COALESCE_DEFERRED && value != MYHEAP_COALESCE_IMMEDIATE &&
+            value != MYHEAP_COALESCE_PENDING) {
+            result = -1;
+            break;
+        }
+        if (value != MYHEAP_COALESCE_PENDING) {
+            drainPending(heap);
+        }
+        if (value == MYHEAP_COALESCE_IMMEDIATE && heap->coalesceMode != value &&
+            heap->regions != NULL) {
+            coalesceAll(heap);
+        }
+        heap->coalesceMode = value;
+        break;
+    case MYHEAP_OPT_THREAD_CACHE:
+        if (heap != &defaultHeap) {
+            result = -1;
+        } else {
+            threadCacheOn = (value != 0);
+        }
+        break;
+    case MYHEAP_OPT_SLAB:
+        heap->slabOn = (value != 0);
+        break;
+    case MYHEAP_OPT_GROW:
+        heap->growOn = (value != 0);
+        break;
+    case MYHEAP_OPT_MMAP_THRESHOLD:
+        if (value < 0) {
+            result = -1;
+        } else {
+            heap->mmapThreshold = value;
+        }
+        break;
+    case MYHEAP_OPT_HUGE_PAGES:
+        heap->hugePagesOn = (value != 0);
+        break;
+    case MYHEAP_OPT_PLACEMENT:
+        if (value < MYHEAP_PLACE_BEST || value > MYHEAP_PLACE_GOOD) {
+            result = -1;
+        } else {
+            heap->placement = value;
+            heap->rover = NULL;
+        }
+        break;
+    case MYHEAP_OPT_FIT_CANDIDATES:
+        if (value < 0) {
+            result = -1;
+        } else {
+            heap->fitCandidates = value;
+        }
+        break;
+    case MYHEAP_OPT_MIN_REMAINDER:
+    case MYHEAP_OPT_CARVE_HIGH:
+        if (value < 0 || (size_t)value > SIZE_MAX / 4) {
+            result = -1;
+        } else if (option == MYHEAP_OPT_MIN_REMAINDER) {
+            heap->minRemainder = ((size_t)value + 7) / 8 * 8;
+        } else {
+            heap->carveHigh = value;
+        }
+        break;
+    case MYHEAP_OPT_RELEASE_THRESHOLD:
+        if (value < 0) {
+            result = -1;
+        } else {
+            heap->releaseThreshold = value;
+        }
+        break;
+    default:
+        result = -1;
+    }
+    pthread_mutex_unlock(&heap->lock);
+    return result;
+}
+
+/*
+ * Function for changing an option of the default heap.
+ * See myHeapSetOption().
+ */
+int mySetOption(int option, long value) {
+    return myHeapSetOption(&defaultHeap, option, value);
+}
+
+/*
+ * Returns the size of the largest block on the highest non-empty free
+ * list, which holds the largest listed block.  Only that one list is
+ * walked, here rather than on every allocation and free, which keep
+ * their order and, with MYHEAP_INDEX_TLSF, their constant time.
+ * Caller must hold the heap's lock.
+ */
+static size_t largestFree(myHeap_t *heap) {
+    blockHeader *traverse = NULL;
+    size_t largest = 0;
+    int class;
+
+    if (heap->index.mode == MYHEAP_INDEX_TLSF) {
+        if (heap->index.flBitmap != 0) {
+            int fl = 63 - __builtin_clzl(heap->index.flBitmap);
+            traverse = heap->index.bins[fl][31 - __builtin_clz(heap->index.slBitmap[fl])];
+        }
+    } else {
+        for (class = NUM_CLASSES - 1; class >= 0 && traverse == NULL; class--) {
+            traverse = heap->index.lists[class];
+        }
+    }
+    for (; traverse != NULL; traverse = linksOf(traverse)->next) {
+        if (blockSize(traverse) > largest) {
+            largest = blockSize(traverse);
+        }
+    }
+    return largest;
+}
+
+/*
+ * Function for reading the running counters of a heap.
+ * Argument heap: heap to read, or NULL for the default heap
+ * Argument stats: filled in with the counters
+ * Returns 0 on success.
+ * Returns -1 if stats is NULL.
+ *
+ * The counters are kept up to date by the allocation and free paths, so
+ * no blocks are walked apart from the one free list that holds the
+ * largest free block.  Free blocks too small to be listed are left out
+ * of largestFree, and neighbours not yet merged by coalesce() count as
+ * separate blocks.  Frees queued by other threads are finished first.
+ * Thread cache hits are added to the counts when the thread next refills
+ * or flushes its cache.  A block moved by myRealloc
+ * counts as one allocation and one free.
+ */
+int myHeapStats(myHeap_t *heap, myStats_t *stats) {
+    if (stats == NULL) {
+        return -1;
+    }
+    if (heap == NULL) {
+        heap = &defaultHeap;
+    }
+    pthread_mutex_lock(&heap->lock);
+    drainRemote(heap);
+    *stats = heap->stats;
+    stats->heapBytes = heap->size;
+    stats->freeBytes = heap->size - heap->stats.usedBytes;
+    stats->largestFree = largestFree(heap);
+    pthread_mutex_unlock(&heap->lock);
+    return 0;
+}
+
+ 
+
+/*
+ * Function for finding out what kind of pages back the heap.
+ * Returns the MYHEAP_PAGES_* value that every region has at least:
+ * MYHEAP_PAGES_HUGETLB for explicit huge pages, MYHEAP_PAGES_TRANSPARENT
+ * when the kernel accepted MADV_HUGEPAGE, and MYHEAP_PAGES_SMALL
+ * otherwise.
+ * Returns -1 if myInit has not been called.
+ */
+int myPageBacking() {
+    myHeap_t *heap = &defaultHeap;
+    heapRegion *region = __atomic_load_n(&heap->regions, __ATOMIC_ACQUIRE);
+    int backing = -1;
+
+    for (; region != NULL; region = region->next) {
+        if (backing == -1 || region->backing < backing) {
+            backing = region->backing;
+        }
+    }
+    return backing;
+}
+
 /* 
  * Function to be used for DEBUGGING to help you visualize your heap structure.
  * Prints out a list of all the blocks including this information:
@@ -330,78 +4661,317 @@ int myInit(int sizeOfRegion) {
  * t_Begin  : address of the first byte in the block (where the header starts) 
  * t_End    : address of the last byte in the block 
  * t_Size   : size of the block as stored in the block header
+ * For large heaps, myHeapSnapshot() and myHeapHistogram() are faster and
+ * easier to process.
  */                     
 void dispMem() {     
+    myHeap_t *heap = &defaultHeap;
  
     int counter;
     char status[6];
     char p_status[6];
     char *t_begin = NULL;
     char *t_end   = NULL;
-    int t_size;
+    size_t t_size;
 
-    blockHeader *current = heapStart;
+    heapRegion *region;
+    blockHeader *current;
     counter = 1;
 
-    int used_size = 0;
-    int free_size = 0;
+    size_t used_size = 0;
+    size_t free_size = 0;
     int is_used   = -1;
 
+    pthread_mutex_lock(&heap->lock);
     fprintf(stdout, 
 	"*********************************** Block List **********************************\n");
     fprintf(stdout, "No.\tStatus\tPrev\tt_Begin\t\tt_End\t\tt_Size\n");
     fprintf(stdout, 
 	"---------------------------------------------------------------------------------\n");
   
-    while (current->size_status != 1) {
-        t_begin = (char*)current;
-        t_size = current->size_status;
+    for (region = heap->regions; region != NULL; region = region->next) {
+        current = region->first;
+        while (statusOf(current) != 1) {
+            t_begin = (char*)current;
+            t_size = statusOf(current);
     
-        if (t_size & 1) {
-            // LSB = 1 => used block
-            strcpy(status, "alloc");
-            is_used = 1;
-            t_size = t_size - 1;
-        } else {
-            strcpy(status, "FREE ");
-            is_used = 0;
-        }
+            if (t_size & 1) {
+                // LSB = 1 => used block
+                strcpy(status, "alloc");
+                is_used = 1;
+                t_size = t_size - 1;
+            } else {
+                strcpy(status, "FREE ");
+                is_used = 0;
+            }
 
-        if (t_size & 2) {
-            strcpy(p_status, "alloc");
-            t_size = t_size - 2;
-        } else {
-            strcpy(p_status, "FREE ");
-        }
+            if (t_size & 2) {
+                strcpy(p_status, "alloc");
+                t_size = t_size - 2;
+            } else {
+                strcpy(p_status, "FREE ");
+            }
+
+            t_size &= ~(size_t)4; // released pages are not shown
 
-        if (is_used) 
-            used_size += t_size;
-        else 
-            free_size += t_size;
+            if (is_used) 
+                used_size += t_size;
+            else 
+                free_size += t_size;
 
-        t_end = t_begin + t_size - 1;
+            t_end = t_begin + t_size - 1;
     
-        fprintf(stdout, "%d\t%s\t%s\t0x%08lx\t0x%08lx\t%4i\n", counter, status, 
-        p_status, (unsigned long int)t_begin, (unsigned long int)t_end, t_size);
+            fprintf(stdout, "%d\t%s\t%s\t0x%08lx\t0x%08lx\t%4zu\n", counter, status, 
+            p_status, (unsigned long int)t_begin, (unsigned long int)t_end, t_size);
     
-        current = (blockHeader*)((char*)current + t_size);
-        counter = counter + 1;
+            current = (blockHeader*)((char*)current + t_size);
+            counter = counter + 1;
+        }
     }
 
     fprintf(stdout, 
 	"---------------------------------------------------------------------------------\n");
     fprintf(stdout, 
 	"*********************************************************************************\n");
-    fprintf(stdout, "Total used size = %4d\n", used_size);
-    fprintf(stdout, "Total free size = %4d\n", free_size);
-    fprintf(stdout, "Total size      = %4d\n", used_size + free_size);
+    fprintf(stdout, "Total used size = %4zu\n", used_size);
+    fprintf(stdout, "Total free size = %4zu\n", free_size);
+    fprintf(stdout, "Total size      = %4zu\n", used_size + free_size);
     fprintf(stdout, 
 	"*********************************************************************************\n");
     fflush(stdout);
+    pthread_mutex_unlock(&heap->lock);
 
     return;  
 } 
 
+// Line kinds of myHeapSnapshot, and the block states
+enum { SNAP_REGION, SNAP_HUGE, SNAP_FREE, SNAP_RELEASED, SNAP_ALLOC, SNAP_SLAB };
+
+/*
+ * One line of myHeapSnapshot, copied out under the heap's lock.
+ */
+typedef struct snapshotRecord {
+    uintptr_t where;   // block offset from its region's first block, or an address
+    size_t size;
+    size_t pageSize;   // regions only
+    int region;
+    int state;         // SNAP_*
+} snapshotRecord;
+
+/*
+ * Function for writing every block of a heap as JSON lines.
+ * Argument heap: heap to dump, or NULL for the default heap
+ * Argument out: stream to write to
+ * Returns 0 on success.
+ * Returns -1 if out is NULL, the blocks cannot be copied or a write fails.
+ *
+ * One object per line: a "heap" line first, then for each region a
+ * "region" line followed by one "block" line per block, then one "huge"
+ * line per directly mapped block.  Block offsets are counted from the
+ * region's first block and sizes include the header.  A block's state is
+ * "free", "alloc" or "slab"; free blocks whose pages were given back
+ * have "released":1.  The blocks are copied out while the heap is
+ * locked and written once it is unlocked, so the dump is consistent but
+ * the stream is never written under the lock.
+ */
+int myHeapSnapshot(myHeap_t *heap, FILE *out) {
+    snapshotRecord *records;
+    size_t count = 0;
+    size_t mapSize;
+    size_t size;
+    size_t used;
+    size_t hugeBytes;
+    size_t i;
+    heapRegion *region;
+    blockHeader *current;
+    hugeHeader *huge;
+    int index = 0;
+
+    if (out == NULL) {
+        return -1;
+    }
+    if (heap == NULL) {
+        heap = &defaultHeap;
+    }
+    pthread_mutex_lock(&heap->lock);
+    drainRemote(heap);
+    for (region = heap->regions; region != NULL; region = region->next) {
+        count++;
+        for (current = region->first; statusOf(current) != 1; current = nextBlockOf(current)) {
+            count++;
+        }
+    }
+    for (huge = heap->hugeBlocks; huge != NULL; huge = huge->next) {
+        count++;
+    }
+    mapSize = (count * sizeof(snapshotRecord) + 4095) / 4096 * 4096;
+    records = NULL;
+    if (mapSize != 0) {
+        records = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (records == MAP_FAILED) {
+        pthread_mutex_unlock(&heap->lock);
+        return -1;
+    }
+    size = heap->size;
+    used = heap->stats.usedBytes;
+    hugeBytes = heap->stats.hugeBytes;
+    count = 0;
+    for (region = heap->regions; region != NULL; region = region->next, index++) {
+        blockHeader *first = region->first;
+        records[count++] = (snapshotRecord){(uintptr_t)first,
+                                            (char *)region->endMark - (char *)first,
+                                            region->pageSize, index, SNAP_REGION};
+        for (current = first; statusOf(current) != 1; current = nextBlockOf(current)) {
+            int state = SNAP_ALLOC;
+            if (isFreeBlock(current)) {
+                state = (statusOf(current) & 4) != 0 ? SNAP_RELEASED : SNAP_FREE;
+            } else if (isSlabPtr(heap, current + 1)) {
+                state = SNAP_SLAB;
+            }
+            records[count++] = (snapshotRecord){(char *)current - (char *)first, blockSize(current),
+                                                0, index, state};
+        }
+    }
+    for (huge = heap->hugeBlocks; huge != NULL; huge = huge->next) {
+        records[count++] = (snapshotRecord){(uintptr_t)(huge + 1), huge->mapSize, 0, 0, SNAP_HUGE};
+    }
+    pthread_mutex_unlock(&heap->lock);
+
+    fprintf(out, "{\"type\":\"heap\",\"size\":%zu,\"used\":%zu,\"huge\":%zu}\n",
+            size, used, hugeBytes);
+    for (i = 0; i < count; i++) {
+        snapshotRecord *r = &records[i];
+        if (r->state == SNAP_REGION) {
+            fprintf(out, "{\"type\":\"region\",\"region\":%d,\"base\":\"%p\",\"size\":%zu,"
+                    "\"pageSize\":%zu}\n", r->region, (void *)r->where, r->size, r->pageSize);
+        } else if (r->state == SNAP_HUGE) {
+            fprintf(out, "{\"type\":\"huge\",\"base\":\"%p\",\"size\":%zu}\n",
+                    (void *)r->where, r->size);
+        } else {
+            fprintf(out, "{\"type\":\"block\",\"region\":%d,\"offset\":%zu,\"size\":%zu,"
+                    "\"state\":\"%s\"%s}\n", r->region, (size_t)r->where, r->size,
+                    r->state == SNAP_ALLOC ? "alloc" : r->state == SNAP_SLAB ? "slab" : "free",
+                    r->state == SNAP_RELEASED ? ",\"released\":1" : "");
+        }
+    }
+    if (records != NULL) {
+        munmap(records, mapSize);
+    }
+    return fflush(out) == 0 && !ferror(out) ? 0 : -1;
+}
+
+/*
+ * Function for counting the free blocks of a heap by size.
+ * Argument heap: heap to look at, or NULL for the default heap
+ * Argument hist: filled in with the histogram
+ * Returns 0 on success.
+ * Returns -1 if hist is NULL.
+ *
+ * Bucket i counts the free blocks whose size, header included, is in
+ * [2^i, 2^(i+1)).  Unlike myHeapStats() this walks every block, so free
+ * blocks too small to be listed and neighbours not yet merged are seen
+ * as they are.  The walk does no I/O.
+ */
+int myHeapHistogram(myHeap_t *heap, myHistogram_t *hist) {
+    heapRegion *region;
+    blockHeader *current;
+
+    if (hist == NULL) {
+        return -1;
+    }
+    if (heap == NULL) {
+        heap = &defaultHeap;
+    }
+    memset(hist, 0, sizeof(*hist));
+    pthread_mutex_lock(&heap->lock);
+    drainRemote(heap);
+    for (region = heap->regions; region != NULL; region = region->next) {
+        for (current = region->first; statusOf(current) != 1;
+             current = nextBlockOf(current)) {
+            size_t size = blockSize(current);
+            int bucket;
+            if (!isFreeBlock(current)) {
+                continue;
+            }
+            bucket = 63 - __builtin_clzl(size);
+            hist->count[bucket]++;
+            hist->bytes[bucket] += size;
+            hist->freeBlocks++;
+            hist->freeBytes += size;
+            if (size > hist->largestFree) {
+                hist->largestFree = size;
+            }
+        }
+    }
+    pthread_mutex_unlock(&heap->lock);
+    if (hist->freeBytes != 0) {
+        hist->fragmentation = 1.0 - (double)hist->largestFree / hist->freeBytes;
+    }
+    return 0;
+}
+
+/*
+ * Function for writing the sampled allocations as a pprof heap profile.
+ * Argument out: stream to write to
+ * Returns 0 on success.
+ * Returns -1 if out is NULL, sampling was never turned on or a write
+ * fails.
+ *
+ * The legacy text format is used ("heap_v2" with the sampling interval
+ * as period), which pprof reads and scales up to estimated totals.  Each
+ * call site gets one line with its live samples and bytes, then, in
+ * brackets, all samples taken there.  /proc/self/maps is appended so
+ * pprof can symbolize the addresses.
+ */
+int myHeapProfile(FILE *out) {
+    unsigned long live = 0;
+    unsigned long allocs = 0;
+    size_t liveBytes = 0;
+    size_t allocBytes = 0;
+    char buffer[4096];
+    ssize_t got;
+    int maps;
+    int i;
+    int j;
+
+    if (out == NULL || samples == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&sampleLock);
+    for (i = 0; i < SAMPLE_SITES; i++) {
+        live += samples->sites[i].live;
+        liveBytes += samples->sites[i].liveBytes;
+        allocs += samples->sites[i].allocs;
+        allocBytes += samples->sites[i].allocBytes;
+    }
+    fprintf(out, "heap profile: %lu: %zu [%lu: %zu] @ heap_v2/%ld\n",
+            live, liveBytes, allocs, allocBytes, sampleInterval != 0 ? sampleInterval : 1);
+    for (i = 0; i < SAMPLE_SITES; i++) {
+        sampleSite *site = &samples->sites[i];
+        if (site->depth == 0) {
+            continue;
+        }
+        fprintf(out, "%lu: %zu [%lu: %zu] @", site->live, site->liveBytes,
+                site->allocs, site->allocBytes);
+        for (j = 0; j < site->depth; j++) {
+            fprintf(out, " %p", site->stack[j]);
+        }
+        fprintf(out, "\n");
+    }
+    pthread_mutex_unlock(&sampleLock);
+
+    fprintf(out, "\nMAPPED_LIBRARIES:\n");
+    maps = open("/proc/self/maps", O_RDONLY);
+    if (maps >= 0) {
+        while ((got = read(maps, buffer, sizeof(buffer))) > 0) {
+            fwrite(buffer, 1, got, out);
+        }
+        close(maps);
+    }
+    return fflush(out) == 0 && !ferror(out) ? 0 : -1;
+}
+
 
 // end of myHeap.c                                      
 
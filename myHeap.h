@@ -0,0 +1,164 @@
+#ifndef __myHeap_h
+#define __myHeap_h
+
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Options accepted by mySetOption().
+ */
+#define MYHEAP_OPT_INDEX         1   // free-block index, one of MYHEAP_INDEX_*
+#define MYHEAP_OPT_COALESCE      2   // merge policy, one of MYHEAP_COALESCE_*
+#define MYHEAP_OPT_THREAD_CACHE  3   // per-thread caches of small blocks, 0 or 1
+#define MYHEAP_OPT_SLAB          4   // headerless slab slots up to 128 bytes, 0 or 1
+#define MYHEAP_OPT_GROW          5   // map more regions when the heap is full, 0 or 1
+#define MYHEAP_OPT_MMAP_THRESHOLD 6  // bytes from which requests get their own mapping
+#define MYHEAP_OPT_RELEASE_THRESHOLD 7 // free block bytes from which coalesce() gives pages back
+#define MYHEAP_OPT_HUGE_PAGES    8   // map regions on 2 MiB pages, 0 or 1
+#define MYHEAP_OPT_PLACEMENT     9   // placement within a size class, one of MYHEAP_PLACE_*
+#define MYHEAP_OPT_FIT_CANDIDATES 10 // blocks that fit looked at by MYHEAP_PLACE_GOOD
+#define MYHEAP_OPT_SAMPLE_INTERVAL 11 // mean bytes between sampled allocations, 0 is off
+#define MYHEAP_OPT_NUMA          12  // allocate from a heap on the caller's NUMA node, 0 or 1
+#define MYHEAP_OPT_SCAVENGE      13  // milliseconds between background scavenger rounds, 0 is off
+#define MYHEAP_OPT_SCAVENGE_RSS  14  // resident bytes above which the scavenger gives pages back
+#define MYHEAP_OPT_MIN_REMAINDER 15  // smallest free block a split may leave, in bytes
+#define MYHEAP_OPT_CARVE_HIGH    16  // requests below this many bytes come from a block's high end
+
+/*
+ * Values for MYHEAP_OPT_INDEX.
+ */
+#define MYHEAP_INDEX_SEGREGATED  0   // power-of-two classes, exact best fit
+#define MYHEAP_INDEX_TLSF        1   // two-level bitmap index, O(1) good fit
+
+/*
+ * Values for MYHEAP_OPT_COALESCE.
+ */
+#define MYHEAP_COALESCE_DEFERRED  0  // merge only when coalesce() is called
+#define MYHEAP_COALESCE_IMMEDIATE 1  // myFree merges with free neighbours
+#define MYHEAP_COALESCE_PENDING   2  // myFree queues blocks, merged around in batches
+
+/*
+ * Values for MYHEAP_OPT_PLACEMENT.  Used by MYHEAP_INDEX_SEGREGATED only.
+ */
+#define MYHEAP_PLACE_BEST  0  // smallest fitting block, stops early on an exact fit
+#define MYHEAP_PLACE_FIRST 1  // first fitting block on the list
+#define MYHEAP_PLACE_NEXT  2  // first fitting block after the last one taken
+#define MYHEAP_PLACE_GOOD  3  // smallest of the first few fitting blocks
+
+/*
+ * Size classes for myAllocClass(): 8-byte steps up to MYHEAP_SMALL_MAX.
+ * MYHEAP_SIZE_CLASS is a constant expression for a constant size.  A
+ * class skips the free-block search only with MYHEAP_OPT_THREAD_CACHE
+ * on, or with MYHEAP_OPT_SLAB on for classes of up to 128 bytes.
+ */
+#define MYHEAP_SMALL_MAX 256
+#define MYHEAP_SIZE_CLASS(size) ((int)(((size) + 7) / 8) - 1)
+
+/*
+ * Lifetimes for myAllocHint().
+ */
+#define MYHEAP_HINT_NONE  0  // like myAlloc
+#define MYHEAP_HINT_SHORT 1  // freed soon, e.g. a request buffer
+#define MYHEAP_HINT_LONG  2  // kept for long, e.g. a cache entry
+
+/*
+ * Values returned by myPageBacking(), from weakest to strongest.
+ */
+#define MYHEAP_PAGES_SMALL       0   // normal pages
+#define MYHEAP_PAGES_TRANSPARENT 1   // transparent huge pages requested with madvise
+#define MYHEAP_PAGES_HUGETLB     2   // explicit huge pages from MAP_HUGETLB
+
+/*
+ * Counters filled in by myHeapStats().  Byte counts include block headers.
+ */
+typedef struct myStats {
+    size_t heapBytes;            // bytes over all regions
+    size_t usedBytes;            // in allocated blocks, slabs included
+    size_t freeBytes;            // in free blocks
+    size_t largestFree;          // largest free block, see myHeapStats()
+    size_t hugeBytes;            // mapped for huge blocks
+    size_t releasedBytes;        // given back to the system by coalesce(), in total
+    unsigned long allocs;        // successful allocations
+    unsigned long frees;         // successful frees
+    unsigned long failedAllocs;  // allocations that returned NULL
+    unsigned long searches;      // free index searches
+    unsigned long blocksScanned; // free blocks looked at by those searches
+} myStats_t;
+
+/*
+ * Free block sizes counted by myHeapHistogram().
+ */
+#define MYHEAP_HIST_BUCKETS 64
+
+typedef struct myHistogram {
+    unsigned long count[MYHEAP_HIST_BUCKETS]; // free blocks of size [2^i, 2^(i+1))
+    size_t bytes[MYHEAP_HIST_BUCKETS];        // bytes in those blocks
+    unsigned long freeBlocks;
+    size_t freeBytes;
+    size_t largestFree;
+    double fragmentation;  // 1 - largestFree / freeBytes, 0 with nothing free
+} myHistogram_t;
+
+/*
+ * A heap of its own, see myHeapCreate().  The functions without a heap
+ * argument work on a default heap set up by myInit().
+ */
+typedef struct myHeap myHeap_t;
+
+int   myInit(size_t sizeOfRegion);
+void  dispMem();
+void* myAlloc(size_t size);
+void* myAllocHint(size_t size, int hint);
+void* myAllocClass(int sizeClass);
+int   myFreeSized(void *ptr, size_t size);
+int   myFree(void *ptr);
+void* myRealloc(void *ptr, size_t size);
+void* myCalloc(size_t count, size_t size);
+void* myCallocAligned(size_t count, size_t size, size_t alignment);
+void* myAllocAligned(size_t size, size_t alignment);
+size_t myUsableSize(void *ptr);
+int   myOwns(void *ptr);
+size_t myAllocBatch(size_t size, size_t count, void **out);
+int   myFreeBatch(void **ptrs, size_t count);
+int   coalesce();
+int   coalesceStep(size_t maxBlocks, unsigned long maxNanos);
+int   mySetOption(int option, long value);
+int   myPageBacking();
+
+myHeap_t* myHeapCreate(size_t size);
+void* myHeapAlloc(myHeap_t *heap, size_t size);
+int   myHeapFree(myHeap_t *heap, void *ptr);
+int   myHeapOwns(myHeap_t *heap, void *ptr);
+void  myHeapDestroy(myHeap_t *heap);
+int   myHeapSetOption(myHeap_t *heap, int option, long value);
+int   myHeapStats(myHeap_t *heap, myStats_t *stats);
+int   myHeapSnapshot(myHeap_t *heap, FILE *out);
+int   myHeapHistogram(myHeap_t *heap, myHistogram_t *hist);
+int   myHeapProfile(FILE *out);
+
+myHeap_t* myHeapOpen(const char *path, size_t size);
+int   myHeapClose(myHeap_t *heap);
+int   myHeapSetRoot(myHeap_t *heap, void *ptr);
+void* myHeapRoot(myHeap_t *heap);
+
+/*
+ * A bump-pointer arena carved out of the heap, see myArenaCreate().
+ */
+typedef struct myArena myArena_t;
+
+myArena_t* myArenaCreate(size_t size);
+void* myArenaAlloc(myArena_t *arena, size_t size);
+size_t myArenaMark(myArena_t *arena);
+void  myArenaRewind(myArena_t *arena, size_t mark);
+void  myArenaReset(myArena_t *arena);
+void  myArenaRelease(myArena_t *arena);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __myHeap_h
@@ -0,0 +1,142 @@
+#ifndef __myHeap_hpp
+#define __myHeap_hpp
+
+/*
+ * C++ adapters for the default heap, header only.  Needs C++17.
+ *
+ *   myheap::resource         a std::pmr::memory_resource
+ *   myheap::allocator<T>     a std::allocator replacement
+ *
+ * Both free with myFreeSized, since C++ always knows the size it frees.
+ * A single object of a type of at most MYHEAP_SMALL_MAX bytes, as in the
+ * nodes of std::map or std::list, is allocated with myAllocClass under a
+ * size class worked out when compiling.  That skips the free-block index
+ * only when the heap has something in front of it:
+ *
+ *   MYHEAP_OPT_THREAD_CACHE on   straight to the thread cache's list
+ *   MYHEAP_OPT_SLAB on           a slab slot, for up to 128 bytes
+ *   neither                      an ordinary search, as for myAlloc
+ *
+ * so turn on one of them to get the fast path.
+ *
+ * myInit must have run before the first allocation.  Failures throw
+ * std::bad_alloc.
+ */
+#include <cstddef>
+#include <limits>
+#include <memory_resource>
+#include <new>
+#include "myHeap.h"
+
+namespace myheap {
+
+/*
+ * Size class of a request of Size bytes, or -1 if myAllocClass does not
+ * serve it.
+ */
+template <std::size_t Size>
+constexpr int sizeClass() {
+    return Size != 0 && Size <= MYHEAP_SMALL_MAX ? MYHEAP_SIZE_CLASS(Size) : -1;
+}
+
+/*
+ * Allocates 'size' bytes aligned to 'alignment', or returns nullptr.
+ */
+inline void *allocate(std::size_t size, std::size_t alignment) {
+    if (size == 0) {
+        size = 1;
+    }
+    return alignment <= 8 ? myAlloc(size) : myAllocAligned(size, alignment);
+}
+
+/*
+ * Allocates one object of Size bytes aligned to Align; the size class of
+ * a small object is a constant here.
+ */
+template <std::size_t Size, std::size_t Align>
+inline void *allocateOne() {
+    if constexpr (Align <= 8 && sizeClass<Size>() >= 0) {
+        return myAllocClass(sizeClass<Size>());
+    } else {
+        return allocate(Size, Align);
+    }
+}
+
+/*
+ * A memory resource over the default heap.  All instances are
+ * interchangeable.
+ */
+class resource : public std::pmr::memory_resource {
+protected:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override {
+        void *ptr = myheap::allocate(bytes, alignment);
+        if (ptr == nullptr) {
+            throw std::bad_alloc();
+        }
+        return ptr;
+    }
+
+    void do_deallocate(void *ptr, std::size_t bytes, std::size_t alignment) override {
+        // An aligned block may be larger in front of ptr, its size is looked up
+        myFreeSized(ptr, alignment <= 8 ? bytes : 0);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return dynamic_cast<const resource *>(&other) != nullptr;
+    }
+};
+
+/*
+ * Returns a resource shared by the whole program.
+ */
+inline resource *defaultResource() {
+    static resource shared;
+    return &shared;
+}
+
+/*
+ * An allocator over the default heap, for any standard container.
+ */
+template <class T>
+class allocator {
+public:
+    using value_type = T;
+
+    allocator() noexcept = default;
+
+    template <class U>
+    allocator(const allocator<U> &) noexcept {}
+
+    T *allocate(std::size_t n) {
+        void *ptr;
+        if (n == 1) {
+            ptr = allocateOne<sizeof(T), alignof(T)>();
+        } else if (n > std::numeric_limits<std::size_t>::max() / 2 / sizeof(T)) {
+            throw std::bad_array_new_length();
+        } else {
+            ptr = myheap::allocate(n * sizeof(T), alignof(T));
+        }
+        if (ptr == nullptr) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T *>(ptr);
+    }
+
+    void deallocate(T *ptr, std::size_t n) noexcept {
+        myFreeSized(ptr, alignof(T) <= 8 ? n * sizeof(T) : 0);
+    }
+};
+
+template <class T, class U>
+bool operator==(const allocator<T> &, const allocator<U> &) noexcept {
+    return true;
+}
+
+template <class T, class U>
+bool operator!=(const allocator<T> &, const allocator<U> &) noexcept {
+    return false;
+}
+
+} // namespace myheap
+
+#endif // __myHeap_hpp
@@ -0,0 +1,277 @@
+/*
+ * malloc interposition shim: runs unmodified programs on the default heap.
+ *
+ * Build:  make libmyheap.so
+ * Run:    LD_PRELOAD=./libmyheap.so ./program
+ *
+ * The heap is set up on the first call, with room for MYHEAP_SIZE MiB
+ * (64 if unset) and growth, slabs, thread caches, the TLSF index,
+ * immediate coalescing and direct mappings from MYHEAP_MMAP_THRESHOLD
+ * bytes (1 MiB if unset) turned on.  Calls made while myInit runs are
+ * served from a small static buffer.  myInit also makes fork() safe.
+ *
+ * malloc must return memory aligned to 16 bytes, while heap payloads are
+ * only 8-aligned.  Requests up to SMALL_SIZE bytes are rounded up to a
+ * multiple of 16 so they get a slab slot, whose address then is a
+ * multiple of 16 as well; anything else goes through myAllocAligned(),
+ * or myCallocAligned() for calloc.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "myHeap.h"
+
+#define DEFAULT_HEAP_MIB    64
+#define DEFAULT_MMAP_BYTES  (1024 * 1024)
+#define BOOTSTRAP_SIZE      (64 * 1024)
+#define MALLOC_ALIGN        16
+#define SMALL_SIZE          128  // largest slab slot, see MYHEAP_OPT_SLAB
+
+static int initDone = 0;
+static pthread_mutex_t initLock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int initializing;
+
+// Blocks handed out while myInit runs; each starts with its size
+static char bootstrap[BOOTSTRAP_SIZE] __attribute__((aligned(16)));
+static size_t bootstrapUsed = 0;
+
+/*
+ * Reads a size from the environment, or returns 'fallback' if it is not
+ * set or not a positive number.
+ */
+static size_t envSize(const char *name, size_t fallback) {
+    const char *value = getenv(name);
+    char *end;
+    unsigned long parsed;
+
+    if (value == NULL) {
+        return fallback;
+    }
+    parsed = strtoul(value, &end, 10);
+    return (end == value || parsed == 0) ? fallback : parsed;
+}
+
+/*
+ * Sets up the default heap on first use.  Returns 1 once it is set up
+ * (even if myInit failed, in which case allocations return NULL), or 0
+ * for a call made by this thread while the set-up is running.
+ */
+static int ensureInit() {
+    if (__atomic_load_n(&initDone, __ATOMIC_ACQUIRE)) {
+        return 1;
+    }
+    if (initializing) {
+        return 0;
+    }
+    initializing = 1;
+    pthread_mutex_lock(&initLock);
+    if (!initDone) {
+        if (myInit(envSize("MYHEAP_SIZE", DEFAULT_HEAP_MIB) << 20) == 0) {
+            mySetOption(MYHEAP_OPT_GROW, 1);
+            mySetOption(MYHEAP_OPT_INDEX, MYHEAP_INDEX_TLSF);
+            mySetOption(MYHEAP_OPT_COALESCE, MYHEAP_COALESCE_IMMEDIATE);
+            mySetOption(MYHEAP_OPT_SLAB, 1);
+            mySetOption(MYHEAP_OPT_THREAD_CACHE, 1);
+            mySetOption(MYHEAP_OPT_MMAP_THRESHOLD,
+                        envSize("MYHEAP_MMAP_THRESHOLD", DEFAULT_MMAP_BYTES));
+        }
+        __atomic_store_n(&initDone, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&initLock);
+    initializing = 0;
+    return 1;
+}
+
+/*
+ * Serves a request made while myInit runs.  Such memory is never reused.
+ */
+static void *bootstrapAlloc(size_t size) {
+    size_t need = (sizeof(size_t) + size + 15) / 16 * 16;
+    char *block;
+
+    if (size > BOOTSTRAP_SIZE || need > BOOTSTRAP_SIZE - bootstrapUsed) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    block = bootstrap + bootstrapUsed;
+    bootstrapUsed += need;
+    *(size_t *)block = size;
+    return block + sizeof(size_t);
+}
+
+static int isBootstrap(void *ptr) {
+    return (char *)ptr >= bootstrap && (char *)ptr < bootstrap + BOOTSTRAP_SIZE;
+}
+
+static void *checked(void *ptr) {
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+static int isAligned(void *ptr) {
+    return ((uintptr_t)ptr & (MALLOC_ALIGN - 1)) == 0;
+}
+
+/*
+ * Allocates at least 'size' bytes aligned to MALLOC_ALIGN.
+ */
+static void *allocAligned(size_t size) {
+    void *ptr;
+
+    if (size > SIZE_MAX / 2) {
+        return NULL;
+    }
+    size = (size + MALLOC_ALIGN - 1) / MALLOC_ALIGN * MALLOC_ALIGN;
+    if (size <= SMALL_SIZE) {
+        ptr = myAlloc(size);
+        if (ptr == NULL || isAligned(ptr)) {
+            return ptr;
+        }
+        myFree(ptr); // not a slot, the slabs could not grow
+    }
+    return myAllocAligned(size, MALLOC_ALIGN);
+}
+
+void *malloc(size_t size) {
+    if (!ensureInit()) {
+        return bootstrapAlloc(size);
+    }
+    return checked(allocAligned(size != 0 ? size : 1));
+}
+
+void free(void *ptr) {
+    if (ptr == NULL || isBootstrap(ptr)) {
+        return;
+    }
+    myFree(ptr);
+}
+
+void *calloc(size_t count, size_t size) {
+    size_t total;
+    void *ptr;
+
+    if (count != 0 && size > SIZE_MAX / count) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    total = count * size;
+    if (!ensureInit()) {
+        return bootstrapAlloc(total); // static memory starts out zero
+    }
+    if (total > SIZE_MAX / 2) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    total = total != 0 ? (total + MALLOC_ALIGN - 1) / MALLOC_ALIGN * MALLOC_ALIGN : MALLOC_ALIGN;
+    if (total <= SMALL_SIZE) {
+        ptr = myCalloc(1, total);
+        if (ptr == NULL || isAligned(ptr)) {
+            return checked(ptr);
+        }
+        myFree(ptr); // not a slot, the slabs could not grow
+    }
+    return checked(myCallocAligned(1, total, MALLOC_ALIGN));
+}
+
+void *realloc(void *ptr, size_t size) {
+    void *moved;
+
+    if (ptr != NULL && isBootstrap(ptr)) {
+        size_t old = *(size_t *)((char *)ptr - sizeof(size_t));
+        moved = malloc(size);
+        if (moved != NULL) {
+            memcpy(moved, ptr, old < size ? old : size);
+        }
+        return moved;
+    }
+    if (!ensureInit()) {
+        return bootstrapAlloc(size);
+    }
+    if (ptr == NULL) {
+        return malloc(size);
+    }
+    if (size == 0) {
+        myFree(ptr);
+        return NULL;
+    }
+    moved = myRealloc(ptr, size);
+    if (moved != NULL && !isAligned(moved)) {
+        // Moved to a block malloc could not have returned, so move it again
+        void *aligned = allocAligned(size);
+        if (aligned != NULL) {
+            memcpy(aligned, moved, size);
+            myFree(moved);
+            moved = aligned;
+        }
+    }
+    return checked(moved);
+}
+
+void *reallocarray(void *ptr, size_t count, size_t size) {
+    if (count != 0 && size > SIZE_MAX / count) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, count * size);
+}
+
+int posix_memalign(void **out, size_t alignment, size_t size) {
+    void *ptr;
+
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    if (!ensureInit()) {
+        return ENOMEM;
+    }
+    ptr = myAllocAligned(size != 0 ? size : 1, alignment);
+    if (ptr == NULL) {
+        return ENOMEM;
+    }
+    *out = ptr;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    void *ptr = NULL;
+    int error = posix_memalign(&ptr, alignment < sizeof(void *) ? sizeof(void *) : alignment, size);
+
+    if (error != 0) {
+        errno = error;
+        return NULL;
+    }
+    return ptr;
+}
+
+void *memalign(size_t alignment, size_t size) {
+    return aligned_alloc(alignment, size);
+}
+
+void *valloc(size_t size) {
+    return aligned_alloc(getpagesize(), size);
+}
+
+void *pvalloc(size_t size) {
+    size_t pagesize = getpagesize();
+
+    if (size > SIZE_MAX - pagesize) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return aligned_alloc(pagesize, (size + pagesize - 1) / pagesize * pagesize);
+}
+
+size_t malloc_usable_size(void *ptr) {
+    if (ptr == NULL) {
+        return 0;
+    }
+    if (isBootstrap(ptr)) {
+        return *(size_t *)((char *)ptr - sizeof(size_t));
+    }
+    return myUsableSize(ptr);
+}